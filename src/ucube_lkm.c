@@ -30,24 +30,77 @@
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <uapi/linux/sched/types.h>
 #include <asm/pgtable.h>
+#include <asm/unaligned.h>
 #include <linux/clk.h>
 #include <linux/device.h>
 #include <linux/fpga/fpga-mgr.h>
 #include <linux/fpga/fpga-region.h>
+#include <linux/io.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/zlib.h>
+#include <linux/zstd.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/dma-buf.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/hrtimer.h>
+#include <linux/eventfd.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+
+#define CREATE_TRACE_POINTS
+#include "ucube_lkm_trace.h"
 
 #define N_MINOR_NUMBERS	4
+#define UCUBE_MAX_INSTANCES 8
 
 #define N_SCOPE_CHANNELS 6
 #define KERNEL_BUFFER_LENGTH N_SCOPE_CHANNELS*1024*sizeof(u64)
-#define BITSTREAM_BUFFER_SIZE 32000000
+#define BITSTREAM_MAX_SIZE (256*1024*1024)
+#define BITSTREAM_CACHE_DEFAULT_SIZE (64*1024*1024)
+
+#define BITSTREAM_GZIP_MAGIC 0x8b1f
+#define BITSTREAM_ZSTD_MAGIC 0xfd2fb528
+#define BITSTREAM_ZSTD_MAX_WINDOW (1 << 23)
+
+#define UCUBE_GZ_FHCRC 0x02
+#define UCUBE_GZ_FEXTRA 0x04
+#define UCUBE_GZ_FNAME 0x08
+#define UCUBE_GZ_FCOMMENT 0x10
+#define UCUBE_GZ_FRESERVED 0xe0
+
+#define UCUBE_DEFAULT_CAPTURE_SLOTS 4
+#define UCUBE_MAX_CAPTURE_SLOTS 64
 
 
 #define IRQ_NUMBER 22
+#define IRQ_THREAD_DEFAULT_PRIO (MAX_RT_PRIO / 2)
 
 #define IOCTL_NEW_DATA_AVAILABLE 1
 #define IOCTL_GET_BUFFER_ADDRESS 2
 #define IOCTL_PROGRAM_FPGA 3
+#define IOCTL_REGISTER_BATCH 4
+#define IOCTL_SET_MAPPING_MODE 5
+#define IOCTL_PROGRAM_FPGA_ASYNC 6
+#define IOCTL_GET_PROGRAM_RESULT 7
+#define IOCTL_STORE_BITSTREAM 8
+#define IOCTL_DROP_BITSTREAM 9
+#define IOCTL_PROGRAM_FPGA_REGION 10
+#define IOCTL_SET_READ_MODE 11
+#define IOCTL_GET_OVERRUNS 12
+#define IOCTL_SET_READ_LAYOUT 13
+#define IOCTL_SET_TRIGGER 14
+#define IOCTL_EXPORT_DMABUF 15
+#define IOCTL_REGISTER_EVENTFD 16
 
 
 #define ZYNQ_BUS_0_ADDRESS_BASE 0x40000000
@@ -64,19 +117,303 @@
 
 
 
+#define UCUBE_REG_OP_READ 0
+#define UCUBE_REG_OP_WRITE 1
+#define UCUBE_REG_OP_RMW 2
+
+#define UCUBE_REG_BATCH_MAX_OPS 4096
+#define UCUBE_REG_WINDOW_SIZE 0x100000
+#define UCUBE_REG_WINDOW_CACHE 16
+
+#define UCUBE_MAP_NONCACHED 0
+#define UCUBE_MAP_WRITECOMBINE 1
+
+#define UCUBE_READ_DATA 0
+#define UCUBE_READ_META 0x1
+#define UCUBE_READ_TRIGGERED 0x2
+
+#define UCUBE_TRIGGER_OFF 0
+#define UCUBE_TRIGGER_LEVEL 1
+#define UCUBE_TRIGGER_RISING 2
+#define UCUBE_TRIGGER_FALLING 3
+#define UCUBE_TRIGGER_WINDOW 4
+#define UCUBE_TRIGGER_WINDOWS 16
+
+#define UCUBE_LAYOUT_INTERLEAVED 0
+#define UCUBE_LAYOUT_PLANAR 1
+#define UCUBE_ALL_CHANNELS GENMASK(N_SCOPE_CHANNELS - 1, 0)
+#define UCUBE_LAYOUT_CHUNK 256
+
+/* SAMPLE FORMATS OF THE CAPTURE RING, raw keeps the bus words as captured
+ * while the packed formats keep the low 16 or 24 bits of each word */
+#define UCUBE_FORMAT_RAW 0
+#define UCUBE_FORMAT_S16 1
+#define UCUBE_FORMAT_S24 2
+
+#define UCUBE_DECIMATE_NONE 0
+#define UCUBE_DECIMATE_STRIDE 1
+#define UCUBE_DECIMATE_AVERAGE 2
+#define UCUBE_DECIMATE_MINMAX 3
+#define UCUBE_MAX_DECIMATION 65536
+
+#define UCUBE_MAX_WC_RANGES 8
+
+#define UCUBE_MAX_FPGA_REGIONS 8
+
+#define UCUBE_HIST_BUCKETS 32
+
+#define UCUBE_COALESCE_DEFAULT_BATCH 16
+#define UCUBE_COALESCE_DEFAULT_TIMEOUT_US 1000
+
+/* EVENT CLASSES THAT CAN BE DELIVERED THROUGH AN EVENTFD, the counter is
+ * increased by the number of events of the class since the last signal */
+#define UCUBE_EVENT_FRAME 0
+#define UCUBE_EVENT_OVERRUN 1
+#define UCUBE_EVENT_PROGRAMMED 2
+#define UCUBE_EVENT_PROGRAM_ERROR 3
+#define UCUBE_N_EVENTS 4
+
+#define UCUBE_PROGRAM_PARTIAL 0x1
+#define UCUBE_PROGRAM_ASYNC 0x2
+
+/* STATE REPORTED BY READING /dev/uscope_bitstream, besides '0' and '1' for an
+ * idle manager without or with a loaded design */
+#define UCUBE_FPGA_IDLE 0
+#define UCUBE_FPGA_PROGRAMMING 1
+#define UCUBE_FPGA_FAILED 2
+
 #define FCLK_0_DEFAULT_FREQ 100000000
 #define FCLK_1_DEFAULT_FREQ 40000000
 #define FCLK_2_DEFAULT_FREQ 40000000
 #define FCLK_3_DEFAULT_FREQ 40000000
 
+/* SHARED CAPTURE HEADER, MAPPED READ-ONLY AT THE START OF /dev/uscope_data
+ *
+ * The header is followed by n_slots frame slots, the first one at data_offset
+ * and each slot_stride bytes apart. Frame number n is stored in slot
+ * n % n_slots and head is the number of frames produced so far, so a mapped
+ * consumer keeps its own index and has been overrun once head - index exceeds
+ * n_slots. The lock of a slot is odd while the frame is being rewritten: a
+ * reader samples lock, consumes the frame and samples it again, discarding the
+ * frame if the two values differ or are odd. timestamp is the CLOCK_MONOTONIC
+ * time in ns at which the frame interrupt was taken, sequence the number of
+ * the frame and dropped the total number of frames lost because their
+ * interrupt was serviced only after the next one had arrived. overruns is the
+ * total number of frames lost by read() consumers across all open files.
+ * Samples are stored in format, sample_width bytes each in little endian;
+ * for the packed formats the channel tag found above the sample bits of the
+ * first sample of each channel is moved to channel_tags.
+ */
+struct ucube_slot_header {
+    u32 lock;
+    u32 length;
+    u64 sequence;
+    u64 timestamp;
+    u64 dropped;
+    u32 format;
+    u32 sample_width;
+    u32 channel_tags[N_SCOPE_CHANNELS];
+};
+
+struct ucube_capture_header {
+    u32 data_offset;
+    u32 slot_stride;
+    u32 n_slots;
+    u32 reserved;
+    u64 head;
+    u64 overruns;
+    struct ucube_slot_header slots[UCUBE_MAX_CAPTURE_SLOTS];
+};
+
+#define UCUBE_HEADER_SIZE PAGE_ALIGN(sizeof(struct ucube_capture_header))
+
+/* RECORD PREFIXED TO EVERY FRAME READ IN UCUBE_READ_META MODE
+ *
+ * sequence, timestamp and dropped are copied from the slot header,
+ * read_timestamp is the CLOCK_MONOTONIC time at which the frame was handed
+ * to the reader and skipped the number of frames this read jumped over
+ * because the reader had been lapped. length is the size of the frame data
+ * following the record.
+ */
+struct ucube_frame_meta {
+    u64 sequence;
+    u64 timestamp;
+    u64 dropped;
+    u64 read_timestamp;
+    u32 length;
+    u32 skipped;
+    u32 format;
+    u32 sample_width;
+};
+
+/* REGISTER BATCH, PASSED TO IOCTL_REGISTER_BATCH ON THE BUS DEVICES
+ *
+ * ops points to n_ops 32 bit register accesses that are validated against the
+ * bus window of the device as a whole and then executed in order. Reads return
+ * the register value in value, read-modify-writes replace the bits selected by
+ * mask with the ones in value and return the value written.
+ */
+struct ucube_reg_op {
+    u64 address;
+    u32 value;
+    u32 mask;
+    u32 op;
+    u32 reserved;
+};
+
+struct ucube_reg_batch {
+    u64 ops;
+    u32 n_ops;
+    u32 reserved;
+};
+
+struct ucube_reg_window {
+    u64 base;
+    void __iomem *regs;
+    u64 last_batch;
+};
+
+/* Bus range without read or write side effects, declared in the wc-ranges
+ * property of the device tree node */
+struct ucube_wc_range {
+    u64 base;
+    u64 size;
+};
+
+/* GZIP HEADER FIELDS, IN FILE ORDER */
+enum ucube_gzip_state {
+    UCUBE_GZ_FIXED,
+    UCUBE_GZ_XLEN,
+    UCUBE_GZ_EXTRA,
+    UCUBE_GZ_NAME,
+    UCUBE_GZ_COMMENT,
+    UCUBE_GZ_HCRC,
+    UCUBE_GZ_DEFLATE,
+    UCUBE_GZ_TRAILER
+};
+
+enum ucube_bitstream_format {
+    UCUBE_BITSTREAM_GZIP,
+    UCUBE_BITSTREAM_ZSTD
+};
+
+/* STATE OF A COMPRESSED UPLOAD BEING INFLATED INTO THE STAGED IMAGE */
+struct ucube_decompressor {
+    enum ucube_bitstream_format format;
+    loff_t in_pos;
+    bool done;
+    u8 *bounce;
+    void *workspace;
+    enum ucube_gzip_state gz_state;
+    u32 gz_count;
+    u32 gz_xlen;
+    u8 gz_flags;
+    u32 gz_crc;
+    u8 gz_trailer[8];
+    z_stream zs;
+    zstd_dstream *zstd;
+};
+
+/* BITSTREAM IMAGE HELD IN INDIVIDUALLY ALLOCATED PAGES */
+struct ucube_bitstream {
+    struct page **pages;
+    unsigned int n_pages;
+    unsigned int pages_cap;
+    size_t len;
+    struct ucube_decompressor *decomp;
+    u8 head[4];
+    u8 head_len;
+};
+
+/* UPLOADED IMAGE KEPT FOR REPROGRAMMING BY HANDLE */
+struct ucube_cached_bitstream {
+    struct list_head node;
+    u32 handle;
+    struct ucube_bitstream image;
+};
+
+/* PROGRAMMING REQUEST FOR A SINGLE FPGA REGION, handle 0 SELECTS THE STAGED UPLOAD */
+struct ucube_program_request {
+    u32 handle;
+    u32 region;
+    u32 flags;
+    u32 reserved;
+};
+
+/* LAYOUT OF THE FRAMES RETURNED BY read(), SET WITH IOCTL_SET_READ_LAYOUT
+ *
+ * Frames are captured as N_SCOPE_CHANNELS interleaved samples. channel_mask
+ * selects the channels to deliver (0 for all of them) and order either keeps
+ * the selected channels interleaved or returns one contiguous array per
+ * channel, in channel order. decimation reduces every run of factor samples
+ * of a channel to its first sample, to the mean of the run or to its minimum
+ * followed by its maximum, with samples taken as signed values. Samples are
+ * returned in the format of the capture ring. Only whole samples, and whole
+ * runs, are returned.
+ */
+struct ucube_read_layout {
+    u32 order;
+    u32 channel_mask;
+    u32 decimation;
+    u32 factor;
+};
+
+/* TRIGGER CONFIGURATION, SET WITH IOCTL_SET_TRIGGER
+ *
+ * The trigger looks at the samples of channel in every captured frame, in the
+ * sample format of the capture ring. A level trigger fires on a sample at or
+ * above level, edge triggers when the signal crosses level in the given
+ * direction and a window trigger on a sample outside [level, level_high].
+ * A hit on frame n makes frames n - pre_frames to n + post_frames available
+ * to readers in UCUBE_READ_TRIGGERED mode, hits within the post-trigger frames
+ * extend the window. pre_frames is limited by the number of capture slots.
+ */
+struct ucube_trigger_config {
+    u32 mode;
+    u32 channel;
+    s64 level;
+    s64 level_high;
+    u32 pre_frames;
+    u32 post_frames;
+};
+
+/* FRAMES [start, end) AROUND ONE OR MORE TRIGGER HITS */
+struct ucube_trigger_window {
+    u64 start;
+    u64 end;
+};
+
+/* IOCTL_REGISTER_EVENTFD ARGUMENT, a negative fd removes the registration
+ * of the file for the event class */
+struct ucube_eventfd_request {
+    s32 fd;
+    u32 event;
+};
+
+/* STATE OF AN OPEN FILE */
+struct ucube_file_data {
+    struct scope_device_data *dev_data;
+    struct mutex lock;
+    struct list_head reader_node;
+    struct list_head event_node;
+    struct eventfd_ctx *events[UCUBE_N_EVENTS];
+    u64 read_tail;
+    u64 overruns;
+    int map_mode;
+    int read_mode;
+    struct ucube_read_layout layout;
+    u32 program_seen;
+};
+
 /* Prototypes for device functions */
-static int ucube_program_fpga(void);
+static void ucube_release_instance(struct kref *ref);
+static int ucube_program_fpga(struct scope_device_data *dev_data, const struct ucube_program_request *req);
 
-bool ucube_fpga_loaded(void);
+bool ucube_fpga_loaded(struct scope_device_data *dev_data);
 static int ucube_lkm_open(struct inode *, struct file *);
 static int ucube_lkm_release(struct inode *, struct file *);
-static ssize_t ucube_lkm_read(struct file *, char *, size_t, loff_t *);
-static ssize_t ucube_lkm_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t ucube_lkm_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t ucube_lkm_write_iter(struct kiocb *, struct iov_iter *);
 static long ucube_lkm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 static int ucube_lkm_mmap(struct file *filp, struct vm_area_struct *vma);
 static __poll_t ucube_lkm_poll(struct file *, struct poll_table_struct *);
@@ -84,246 +421,1423 @@ int ucube_lkm_probe(struct platform_device *dev);
 int ucube_lkm_remove(struct platform_device *dev);
 
 
+/* Every matching DT node is a separate instance with its own set of minors,
+ * instance n owning minors [n * N_MINOR_NUMBERS, (n + 1) * N_MINOR_NUMBERS) */
 static dev_t device_number;
 static struct class *uCube_class;
-static struct scope_device_data *dev_data;
+static struct scope_device_data *ucube_instances[UCUBE_MAX_INSTANCES];
+static DEFINE_MUTEX(ucube_instances_lock);
+static DEFINE_IDA(ucube_ida);
+
+/* Role of the minor within its instance: data, bus 0, bus 1 or bitstream */
+static int ucube_minor(struct inode *inode){
+    return MINOR(inode->i_rdev) % N_MINOR_NUMBERS;
+}
+
+static struct scope_device_data *ucube_file_dev(struct file *filp){
+    struct ucube_file_data *file_data = filp->private_data;
+    return file_data->dev_data;
+}
+
+static unsigned int capture_slots = UCUBE_DEFAULT_CAPTURE_SLOTS;
+module_param(capture_slots, uint, S_IRUGO);
+MODULE_PARM_DESC(capture_slots, "Number of frame slots in the capture ring");
+
+static int irq_cpu = -1;
+module_param(irq_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(irq_cpu, "CPU the capture interrupt and its thread of the first instance are bound to, later instances take the following CPUs (-1 for no preference)");
+
+static unsigned int irq_thread_prio = IRQ_THREAD_DEFAULT_PRIO;
+module_param(irq_thread_prio, uint, S_IRUGO);
+MODULE_PARM_DESC(irq_thread_prio, "SCHED_FIFO priority of the capture interrupt thread");
 
-static int irq_line;
+static bool dma_cached;
+module_param(dma_cached, bool, S_IRUGO);
+MODULE_PARM_DESC(dma_cached, "Allocate a cacheable DMA buffer and sync it around every frame");
+
+static unsigned int coalesce_rate;
+module_param(coalesce_rate, uint, S_IRUGO);
+MODULE_PARM_DESC(coalesce_rate, "Frame rate in Hz above which reader wakeups are batched (0 to always wake per frame)");
+
+static unsigned int sample_format = UCUBE_FORMAT_RAW;
+module_param(sample_format, uint, S_IRUGO);
+MODULE_PARM_DESC(sample_format, "Sample format of the capture ring: 0 raw bus words, 1 packed 16 bit, 2 packed 24 bit");
+
+static unsigned long bitstream_cache_size = BITSTREAM_CACHE_DEFAULT_SIZE;
+module_param(bitstream_cache_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(bitstream_cache_size, "Memory budget in bytes for bitstreams kept for reprogramming");
 
 /* STRUCTURE FOR THE DEVICE SPECIFIC DATA*/
 struct scope_device_data {
-    struct device_node *fpga_node;
-    struct device devs[N_MINOR_NUMBERS];
+    struct kref ref;
+    bool dead;
+    int id;
+    struct device *dev;
+    dev_t devt;
+    int irq;
+    struct device_node *fpga_nodes[UCUBE_MAX_FPGA_REGIONS];
+    unsigned int n_fpga_regions;
     struct cdev cdevs[N_MINOR_NUMBERS];
-    u32 *read_data_buffer_32;
-    u64 *read_data_buffer_64;
-    u32 *dma_buffer_32;
-    u64 *dma_buffer_64;
-    u8 *bitstream_buffer;
-    size_t bitstream_len; 
+    void *capture_area;
+    size_t capture_area_size;
+    struct ucube_capture_header *capture_header;
+    atomic_t capture_mappings;
+    u32 capture_slots;
+    u32 slot_stride;
+    u32 write_slot;
+    u64 capture_head;
+    wait_queue_head_t capture_wq;
+    struct list_head capture_readers;
+    struct list_head event_files;
+    spinlock_t event_lock;
+    struct ucube_trigger_config trigger;
+    struct ucube_trigger_window trigger_windows[UCUBE_TRIGGER_WINDOWS];
+    u64 trigger_events;
+    atomic_t trigger_wake_pending;
+    s64 trigger_prev;
+    bool trigger_armed;
+    spinlock_t trigger_lock;
+    wait_queue_head_t trigger_wq;
+    u32 coalesce_rate;
+    u32 coalesce_batch;
+    u32 coalesce_timeout_us;
+    bool coalescing;
+    u64 coalesce_interval_ns;
+    u64 coalesce_last_irq;
+    u64 coalesce_since;
+    u64 coalesce_time_ns[2];
+    atomic_t coalesce_pending;
+    struct hrtimer coalesce_timer;
+    struct rw_semaphore capture_lock;
+    spinlock_t read_stats_lock;
+    u64 irq_timestamp;
+    atomic_t irq_pending;
+    u64 missed_frames;
+    u64 torn_reads;
+    int irq_cpu;
+    u32 irq_thread_prio;
+    atomic_t irq_thread_prio_changed;
+    void *dma_buffer;
+    u32 dma_word_size;
+    u32 sample_format;
+    struct ucube_bitstream bitstream;
+    struct mutex bitstream_lock;
+    struct list_head bitstream_cache;
+    size_t bitstream_cache_limit;
+    size_t bitstream_cache_bytes;
+    unsigned int bitstream_cache_entries;
+    u64 bitstream_cache_hits;
+    u64 bitstream_cache_misses;
+    struct ucube_program_request program_req;
+    struct ucube_bitstream program_image;
+    struct work_struct program_work;
+    spinlock_t program_state_lock;
+    int program_state;
+    int program_result;
+    u32 program_count;
+    wait_queue_head_t program_wq;
     dma_addr_t physaddr;
-    int new_data_available;
+    bool dma_cached;
+    u64 dma_sync_count;
+    u64 dma_sync_cpu_ns;
+    u64 dma_sync_device_ns;
+    struct ucube_reg_window reg_windows[UCUBE_REG_WINDOW_CACHE];
+    u64 reg_batch_id;
+    struct mutex reg_lock;
+    struct ucube_wc_range wc_ranges[UCUBE_MAX_WC_RANGES];
+    u64 read_latency_hist[UCUBE_HIST_BUCKETS];
+    u64 copy_time_hist[UCUBE_HIST_BUCKETS];
+    struct dentry *debugfs_dir;
+    int n_wc_ranges;
     struct clk *fclk[4];
     bool is_zynqmp;
     u32 dma_buf_size;
 };
 
 
-int ucube_program_fpga(void){
-    int ret;
-    struct fpga_image_info *info;
-    struct fpga_region *region;
-
-
-    pr_info("%s: Start FPGA programming", __func__);
-
-    
-    region = fpga_region_class_find(NULL, dev_data->fpga_node, device_match_of_node);
-    if (!region) return -ENODEV;
-
-
-    info = fpga_image_info_alloc(&dev_data->devs[3]);
-    if (!info) return -ENOMEM;
-    
-    info->buf = dev_data->bitstream_buffer;
-    info->count = dev_data->bitstream_len;
-    region->info = info;
-    ret = fpga_region_program_fpga(region);
-
-    pr_info("%s: Programming successfull", __func__);
+/* Bitstreams are held in individually allocated pages that are added as the
+ * image is written. The staged upload is released once it has been programmed,
+ * so no memory is held while the driver is idle unless the image was moved to
+ * the cache. Called with bitstream_lock held. */
+static int ucube_bitstream_reserve(struct ucube_bitstream *image, size_t size){
+    unsigned int n_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+    struct page **pages;
+
+    if(n_pages > image->pages_cap){
+        unsigned int cap = max(n_pages, 2 * image->pages_cap);
+        pages = kvmalloc_array(cap, sizeof(*pages), GFP_KERNEL);
+        if(!pages) return -ENOMEM;
+        if(image->n_pages)
+            memcpy(pages, image->pages, image->n_pages * sizeof(*pages));
+        kvfree(image->pages);
+        image->pages = pages;
+        image->pages_cap = cap;
+    }
 
-    region->info = NULL;
-    fpga_image_info_free(info);
+    while(image->n_pages < n_pages){
+        struct page *page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if(!page) return -ENOMEM;
+        image->pages[image->n_pages++] = page;
+    }
+    return 0;
+}
 
-    put_device(&region->dev);
+static void ucube_decomp_free(struct ucube_bitstream *image){
+    if(!image->decomp)
+        return;
+    kvfree(image->decomp->workspace);
+    free_page((unsigned long)image->decomp->bounce);
+    kfree(image->decomp);
+    image->decomp = NULL;
+}
 
-    return ret;
+static void ucube_bitstream_free(struct ucube_bitstream *image){
+    ucube_decomp_free(image);
+    for(unsigned int i = 0; i < image->n_pages; i++)
+        __free_page(image->pages[i]);
+    kvfree(image->pages);
+    image->pages = NULL;
+    image->n_pages = 0;
+    image->pages_cap = 0;
+    image->len = 0;
+    image->head_len = 0;
 }
 
+static int ucube_bitstream_copy_from_iter(struct ucube_bitstream *image, loff_t offset, struct iov_iter *from, size_t len){
+    while(len){
+        size_t page_offset = offset & ~PAGE_MASK;
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - page_offset);
+        u8 *dst = page_address(image->pages[offset >> PAGE_SHIFT]);
 
-bool ucube_fpga_loaded(void){
-    
-    struct fpga_region *region;
-    struct fpga_manager *mgr;
-    region = fpga_region_class_find(NULL, dev_data->fpga_node, device_match_of_node);
-    if (!region) {
-        pr_err("%s: FPGA region not found\n", __func__);
-        return -ENODEV;
-    }
-    
-    // Get the FPGA manager from the region
-    mgr = region->mgr;
-    if (!mgr) {
-        put_device(&region->dev);
-        pr_err("%s: FPGA manager not found\n", __func__);
-        return -ENODEV;
+        if(copy_from_iter(dst + page_offset, chunk, from) != chunk)
+            return -EFAULT;
+        offset += chunk;
+        len -= chunk;
     }
-
-    put_device(&region->dev);
-
-    return mgr->state == FPGA_MGR_STATE_OPERATING;
+    return 0;
 }
 
-static ssize_t fclk_0_show(struct device *dev, struct device_attribute *mattr, char *data) {
-    if(!dev_data->is_zynqmp){
-        unsigned long freq = clk_get_rate(dev_data->fclk[0]);
-        return sprintf(data, "%lu\n", freq);
+/* Uploads starting with a gzip or zstd magic number are inflated into the
+ * staged pages as they are written, so the compressed image is never held
+ * in memory. Compressed uploads must be written sequentially. */
+static int ucube_decomp_init(struct ucube_bitstream *image, const u8 *magic){
+    struct ucube_decompressor *d;
+    size_t size;
+
+    d = kzalloc(sizeof(*d), GFP_KERNEL);
+    if(!d)
+        return -ENOMEM;
+    image->decomp = d;
+
+    d->bounce = (u8 *)__get_free_page(GFP_KERNEL);
+    if(!d->bounce)
+        goto out_nomem;
+
+    if(get_unaligned_le16(magic) == BITSTREAM_GZIP_MAGIC){
+        if(!IS_ENABLED(CONFIG_ZLIB_INFLATE))
+            goto out_unsupported;
+        d->format = UCUBE_BITSTREAM_GZIP;
+        d->workspace = kvmalloc(zlib_inflate_workspacesize(), GFP_KERNEL);
+        if(!d->workspace)
+            goto out_nomem;
+        d->zs.workspace = d->workspace;
+        if(zlib_inflateInit2(&d->zs, -MAX_WBITS) != Z_OK)
+            goto out_unsupported;
+        d->gz_crc = ~0;
     } else {
-        return 0;
+        if(!IS_ENABLED(CONFIG_ZSTD_DECOMPRESS))
+            goto out_unsupported;
+        d->format = UCUBE_BITSTREAM_ZSTD;
+        size = zstd_dstream_workspace_bound(BITSTREAM_ZSTD_MAX_WINDOW);
+        d->workspace = kvmalloc(size, GFP_KERNEL);
+        if(!d->workspace)
+            goto out_nomem;
+        d->zstd = zstd_init_dstream(BITSTREAM_ZSTD_MAX_WINDOW, d->workspace, size);
+        if(!d->zstd)
+            goto out_unsupported;
     }
+    return 0;
+
+out_nomem:
+    ucube_decomp_free(image);
+    return -ENOMEM;
+out_unsupported:
+    ucube_decomp_free(image);
+    return -EOPNOTSUPP;
 }
-static ssize_t fclk_1_show(struct device *dev, struct device_attribute *mattr, char *data) {
-    if(!dev_data->is_zynqmp){
-        unsigned long freq = clk_get_rate(dev_data->fclk[1]);
-        return sprintf(data, "%lu\n", freq);
-    } else {
-        return 0;
-    }
+
+static const u8 ucube_gzip_state_flag[] = {
+    [UCUBE_GZ_XLEN] = UCUBE_GZ_FEXTRA,
+    [UCUBE_GZ_EXTRA] = UCUBE_GZ_FEXTRA,
+    [UCUBE_GZ_NAME] = UCUBE_GZ_FNAME,
+    [UCUBE_GZ_COMMENT] = UCUBE_GZ_FCOMMENT,
+    [UCUBE_GZ_HCRC] = UCUBE_GZ_FHCRC,
+};
+
+/* Moves to the next header field present in this member */
+static void ucube_gzip_advance(struct ucube_decompressor *d){
+    d->gz_count = 0;
+    do {
+        d->gz_state++;
+    } while(d->gz_state != UCUBE_GZ_DEFLATE && !(d->gz_flags & ucube_gzip_state_flag[d->gz_state]));
 }
-static ssize_t fclk_2_show(struct device *dev, struct device_attribute *mattr, char *data) {
-    if(!dev_data->is_zynqmp){
-        unsigned long freq = clk_get_rate(dev_data->fclk[2]);
-        return sprintf(data, "%lu\n", freq);
-    } else {
-        return 0;
+
+/* Consumes the gzip member header, which may be split across writes */
+static int ucube_gzip_header(struct ucube_decompressor *d, const u8 **in, size_t *avail){
+    while(*avail && d->gz_state < UCUBE_GZ_DEFLATE){
+        u8 c = *(*in)++;
+        (*avail)--;
+
+        switch(d->gz_state){
+        case UCUBE_GZ_FIXED:
+            if(d->gz_count == 2 && c != 8)
+                return -EINVAL;
+            if(d->gz_count == 3){
+                if(c & UCUBE_GZ_FRESERVED)
+                    return -EINVAL;
+                d->gz_flags = c;
+            }
+            if(++d->gz_count == 10)
+                ucube_gzip_advance(d);
+            break;
+        case UCUBE_GZ_XLEN:
+            d->gz_xlen |= c << (8 * d->gz_count);
+            if(++d->gz_count == 2){
+                if(!d->gz_xlen)
+                    ucube_gzip_advance(d);
+                ucube_gzip_advance(d);
+            }
+            break;
+        case UCUBE_GZ_EXTRA:
+            if(++d->gz_count == d->gz_xlen)
+                ucube_gzip_advance(d);
+            break;
+        case UCUBE_GZ_NAME:
+        case UCUBE_GZ_COMMENT:
+            if(!c)
+                ucube_gzip_advance(d);
+            break;
+        case UCUBE_GZ_HCRC:
+            if(++d->gz_count == 2)
+                ucube_gzip_advance(d);
+            break;
+        default:
+            break;
+        }
     }
+    return 0;
 }
-static ssize_t fclk_3_show(struct device *dev, struct device_attribute *mattr, char *data) {
-    if(!dev_data->is_zynqmp){
-        unsigned long freq = clk_get_rate(dev_data->fclk[3]);
-        return sprintf(data, "%lu\n", freq);
-    } else {
+
+/* Checks the CRC32 and ISIZE fields that follow the deflate stream against
+ * the inflated image, which may be split across writes */
+static int ucube_gzip_trailer(struct ucube_bitstream *image, const u8 **in, size_t *avail){
+    struct ucube_decompressor *d = image->decomp;
+    size_t chunk = min_t(size_t, *avail, sizeof(d->gz_trailer) - d->gz_count);
+
+    memcpy(d->gz_trailer + d->gz_count, *in, chunk);
+    d->gz_count += chunk;
+    *in += chunk;
+    *avail -= chunk;
+    if(d->gz_count < sizeof(d->gz_trailer))
         return 0;
-    }
+
+    if(get_unaligned_le32(d->gz_trailer) != (d->gz_crc ^ ~0) ||
+       get_unaligned_le32(d->gz_trailer + 4) != (u32)image->len)
+        return -EINVAL;
+    d->done = true;
+    return 0;
 }
 
-ssize_t fclk_0_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
-    if(!dev_data->is_zynqmp){
-        unsigned long freq;
-        if(kstrtoul(buf, 0, &freq))
-            return -EINVAL;
-        clk_set_rate(dev_data->fclk[0], freq);
-        return len;
-    } else {
-        return 0;
+/* Inflates one chunk of compressed input into the staged pages, one output
+ * page at a time. Both decoders can hold decoded data after taking all of
+ * the input, so a filled page is always followed by another call. A gzip
+ * stream is only complete once its trailer has been verified; input past
+ * the end of the compressed stream is ignored. */
+static int ucube_decomp_feed(struct ucube_bitstream *image, const u8 *in, size_t avail){
+    struct ucube_decompressor *d = image->decomp;
+    size_t out_avail, consumed, produced;
+    u8 *out;
+    bool full = false;
+    int rc;
+
+    if(d->format == UCUBE_BITSTREAM_GZIP){
+        rc = ucube_gzip_header(d, &in, &avail);
+        if(rc)
+            return rc;
     }
-}
 
-static ssize_t fclk_1_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
-    if(!dev_data->is_zynqmp){
-        unsigned long freq;
-        if(kstrtoul(buf, 0, &freq))
-            return -EINVAL;
-        clk_set_rate(dev_data->fclk[1], freq);
-        return len;
-    } else {
-        return 0;
+    while((avail || full) && !d->done){
+        if(d->gz_state == UCUBE_GZ_TRAILER){
+            if(!avail)
+                break;
+            rc = ucube_gzip_trailer(image, &in, &avail);
+            if(rc)
+                return rc;
+            continue;
+        }
+        if(image->len >= BITSTREAM_MAX_SIZE)
+            return -EFBIG;
+        rc = ucube_bitstream_reserve(image, image->len + 1);
+        if(rc)
+            return rc;
+        out = (u8 *)page_address(image->pages[image->len >> PAGE_SHIFT]) + (image->len & ~PAGE_MASK);
+        out_avail = PAGE_SIZE - (image->len & ~PAGE_MASK);
+
+        if(d->format == UCUBE_BITSTREAM_GZIP){
+            d->zs.next_in = in;
+            d->zs.avail_in = avail;
+            d->zs.next_out = out;
+            d->zs.avail_out = out_avail;
+            rc = zlib_inflate(&d->zs, Z_NO_FLUSH);
+            if(rc == Z_STREAM_END){
+                d->gz_state = UCUBE_GZ_TRAILER;
+                d->gz_count = 0;
+            } else if(rc != Z_OK && !(rc == Z_BUF_ERROR && !avail))
+                return -EINVAL;
+            consumed = avail - d->zs.avail_in;
+            produced = out_avail - d->zs.avail_out;
+            d->gz_crc = crc32_le(d->gz_crc, out, produced);
+        } else {
+            zstd_in_buffer zin = { .src = in, .size = avail, .pos = 0 };
+            zstd_out_buffer zout = { .dst = out, .size = out_avail, .pos = 0 };
+            size_t ret = zstd_decompress_stream(d->zstd, &zout, &zin);
+            if(zstd_is_error(ret))
+                return -EINVAL;
+            if(!ret)
+                d->done = true;
+            consumed = zin.pos;
+            produced = zout.pos;
+        }
+
+        if(!consumed && !produced && !d->done && rc != Z_STREAM_END){
+            if(avail)
+                return -EINVAL;
+            break;
+        }
+        in += consumed;
+        avail -= consumed;
+        image->len += produced;
+        full = produced == out_avail;
     }
+    return 0;
 }
 
-static ssize_t fclk_2_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
-    if(!dev_data->is_zynqmp){
-        unsigned long freq;
-        if(kstrtoul(buf, 0, &freq))
-            return -EINVAL;
-        clk_set_rate(dev_data->fclk[2], freq);
-        return len;
-    } else {
-        return 0;
+static int ucube_decomp_write(struct ucube_bitstream *image, loff_t offset, struct iov_iter *from, size_t len){
+    struct ucube_decompressor *d = image->decomp;
+    size_t chunk;
+    int rc;
+
+    if(offset != d->in_pos)
+        return -EINVAL;
+
+    while(len){
+        chunk = min_t(size_t, len, PAGE_SIZE);
+        if(copy_from_iter(d->bounce, chunk, from) != chunk)
+            return -EFAULT;
+        rc = ucube_decomp_feed(image, d->bounce, chunk);
+        if(rc)
+            return rc;
+        d->in_pos += chunk;
+        len -= chunk;
     }
+    return 0;
 }
 
-static ssize_t fclk_3_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
-    if(!dev_data->is_zynqmp){
-        unsigned long freq;
-        if(kstrtoul(buf, 0, &freq))
-            return -EINVAL;
-        clk_set_rate(dev_data->fclk[3], freq);
-        return len;
-    } else {
-        return 0;
+/* Stores the bytes held back for format detection, inflating them when they
+ * start a compressed stream */
+static int ucube_bitstream_flush_head(struct ucube_bitstream *image){
+    size_t n = image->head_len;
+    int rc;
+
+    image->head_len = 0;
+    if(n == sizeof(image->head) && (get_unaligned_le16(image->head) == BITSTREAM_GZIP_MAGIC ||
+                                    get_unaligned_le32(image->head) == BITSTREAM_ZSTD_MAGIC)){
+        rc = ucube_decomp_init(image, image->head);
+        if(rc)
+            return rc;
+        image->decomp->in_pos = n;
+        return ucube_decomp_feed(image, image->head, n);
     }
+    rc = ucube_bitstream_reserve(image, n);
+    if(rc)
+        return rc;
+    memcpy(page_address(image->pages[0]), image->head, n);
+    image->len = n;
+    return 0;
 }
 
-static ssize_t dma_addr_show(struct device *dev, struct device_attribute *mattr, char *data) {
-    #if defined(__arm__)
-    return sprintf(data, "%lu\n", dev_data->physaddr);
-    #elif defined(__aarch64__)
-    return sprintf(data, "%llu\n", dev_data->physaddr);
-    #else
-    printk(KERN_ALERT "Hello, kernel. Unknown mode!\n");
-    return 0
-    #endif
-}
+/* A compressed upload can only be programmed or cached once the stream has
+ * been fully inflated; the decompressor is then no longer needed. An upload
+ * too short to carry a magic number is stored as is. */
+static int ucube_decomp_finish(struct ucube_bitstream *image){
+    int rc;
 
-static ssize_t dma_addr_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    if(image->head_len){
+        rc = ucube_bitstream_flush_head(image);
+        if(rc)
+            return rc;
+    }
+    if(!image->decomp)
         return 0;
+    if(!image->decomp->done)
+        return -EINVAL;
+    ucube_decomp_free(image);
+    return 0;
+}
+
+static void ucube_cache_remove(struct scope_device_data *dev_data, struct ucube_cached_bitstream *entry){
+    list_del(&entry->node);
+    dev_data->bitstream_cache_bytes -= (size_t)entry->image.n_pages * PAGE_SIZE;
+    dev_data->bitstream_cache_entries--;
+    ucube_bitstream_free(&entry->image);
+    kfree(entry);
 }
 
+/* Drops the least recently used images until the cache fits its budget */
+static void ucube_cache_trim(struct scope_device_data *dev_data){
+    struct ucube_cached_bitstream *entry;
 
-static ssize_t dma_buf_size_show(struct device *dev, struct device_attribute *mattr, char *data) {
-    return sprintf(data, "%u\n", dev_data->dma_buf_size);
+    while(dev_data->bitstream_cache_bytes > dev_data->bitstream_cache_limit){
+        entry = list_last_entry(&dev_data->bitstream_cache, struct ucube_cached_bitstream, node);
+        pr_info("%s: evicting cached bitstream %u\n", __func__, entry->handle);
+        ucube_cache_remove(dev_data, entry);
+    }
 }
 
-static ssize_t dma_buf_size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
-    unsigned long size;
-    u64 prev_size;
-    if(kstrtoul(buf, 0, &size))
-        return -EINVAL;
-    
-    pr_info("%s: Requested buffer size: %s\n", __func__, buf);
-    
-    prev_size = dev_data->dma_buf_size;
+static struct ucube_cached_bitstream *ucube_cache_find(struct scope_device_data *dev_data, u32 handle){
+    struct ucube_cached_bitstream *entry;
 
-    dev_data->dma_buf_size = size;
-        
-    if(!dev_data->is_zynqmp){
-        dma_free_coherent(
-            &dev_data->devs[0],
-            prev_size,
-            dev_data->dma_buffer_32,
-            dev_data->physaddr
-        );
-
-        dev_data->dma_buffer_32 = dma_alloc_coherent(
-            &dev_data->devs[0],
-            dev_data->dma_buf_size,
-            &(dev_data->physaddr),
-            GFP_KERNEL ||GFP_ATOMIC
-        );
-
-
-        vfree(dev_data->read_data_buffer_32);
-        dev_data->read_data_buffer_32 = vmalloc(dev_data->dma_buf_size);
-    } else{
+    list_for_each_entry(entry, &dev_data->bitstream_cache, node){
+        if(entry->handle == handle)
+            return entry;
+    }
+    return NULL;
+}
 
-        dma_free_coherent(
-            &dev_data->devs[0],
-            prev_size,
-            dev_data->dma_buffer_64,
-            dev_data->physaddr
-        );
+/* Moves the staged upload into the cache under handle, replacing any image
+ * previously stored with the same handle */
+static int ucube_bitstream_store(struct scope_device_data *dev_data, u32 handle){
+    struct ucube_cached_bitstream *entry, *old;
+    size_t size;
+    int rc = 0;
 
-        dev_data->dma_buffer_64 = dma_alloc_coherent(
-            &dev_data->devs[0],
-            dev_data->dma_buf_size,
-            &(dev_data->physaddr),
-            GFP_KERNEL ||GFP_ATOMIC
-        );
+    if(!handle)
+        return -EINVAL;
 
-        vfree(dev_data->read_data_buffer_64);
-        dev_data->read_data_buffer_64 = vmalloc(dev_data->dma_buf_size);
+    mutex_lock(&dev_data->bitstream_lock);
+    rc = ucube_decomp_finish(&dev_data->bitstream);
+    if(rc)
+        goto out;
+    size = (size_t)dev_data->bitstream.n_pages * PAGE_SIZE;
+    if(!dev_data->bitstream.len){
+        rc = -EINVAL;
+        goto out;
+    }
+    if(size > dev_data->bitstream_cache_limit){
+        rc = -ENOSPC;
+        goto out;
     }
 
-    return len;
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if(!entry){
+        rc = -ENOMEM;
+        goto out;
+    }
+    old = ucube_cache_find(dev_data, handle);
+    if(old)
+        ucube_cache_remove(dev_data, old);
+
+    entry->handle = handle;
+    entry->image = dev_data->bitstream;
+    memset(&dev_data->bitstream, 0, sizeof(dev_data->bitstream));
+    list_add(&entry->node, &dev_data->bitstream_cache);
+    dev_data->bitstream_cache_bytes += size;
+    dev_data->bitstream_cache_entries++;
+    ucube_cache_trim(dev_data);
+out:
+    mutex_unlock(&dev_data->bitstream_lock);
+    return rc;
 }
 
-static DEVICE_ATTR(fclk_0, S_IRUGO|S_IWUSR, fclk_0_show, fclk_0_store);
-static DEVICE_ATTR(fclk_1, S_IRUGO|S_IWUSR, fclk_1_show, fclk_1_store);
-static DEVICE_ATTR(fclk_2, S_IRUGO|S_IWUSR, fclk_2_show, fclk_2_store);
+static int ucube_bitstream_drop(struct scope_device_data *dev_data, u32 handle){
+    struct ucube_cached_bitstream *entry;
+    int rc = 0;
+
+    mutex_lock(&dev_data->bitstream_lock);
+    entry = ucube_cache_find(dev_data, handle);
+    if(entry)
+        ucube_cache_remove(dev_data, entry);
+    else
+        rc = -ENOENT;
+    mutex_unlock(&dev_data->bitstream_lock);
+    return rc;
+}
+
+/* Programs the cached image stored under req->handle, or the upload taken by
+ * ucube_program_take() when the handle is 0, into the requested region. Partial requests leave the logic
+ * outside the region running. */
+int ucube_program_fpga(struct scope_device_data *dev_data, const struct ucube_program_request *req){
+    int ret;
+    struct fpga_image_info *info;
+    struct fpga_region *region;
+    struct ucube_bitstream *image;
+    struct ucube_cached_bitstream *entry = NULL;
+    struct sg_table sgt;
+    void *buf = NULL;
+    bool programmed = false;
+
+
+    u64 start = ktime_get_ns();
+
+    if(req->region >= dev_data->n_fpga_regions)
+        return -EINVAL;
+
+    mutex_lock(&dev_data->bitstream_lock);
+    if(req->handle){
+        entry = ucube_cache_find(dev_data, req->handle);
+        if(!entry){
+            dev_data->bitstream_cache_misses++;
+            ret = -ENOENT;
+            goto out_unlock;
+        }
+        dev_data->bitstream_cache_hits++;
+        list_move(&entry->node, &dev_data->bitstream_cache);
+        image = &entry->image;
+    } else {
+        image = &dev_data->program_image;
+    }
+
+    ret = ucube_decomp_finish(image);
+    if(ret)
+        goto out_unlock;
+    if(!image->len){
+        ret = -EINVAL;
+        goto out_unlock;
+    }
+
+    trace_ucube_program_start(req->region, req->handle, req->flags, image->len);
+    region = fpga_region_class_find(NULL, dev_data->fpga_nodes[req->region], device_match_of_node);
+    if (!region){
+        ret = -ENODEV;
+        goto out_unlock;
+    }
+
+
+    info = fpga_image_info_alloc(dev_data->dev);
+    if (!info){
+        ret = -ENOMEM;
+        goto out_put;
+    }
+
+    /* Managers with write_sg (zynq-fpga on Zynq-7000) take the pages as they
+     * are. The others, zynqmp-fpga and versal-fpga among them, get a single
+     * write() per scatterlist entry and treat each one as a whole image, so
+     * they are handed the bitstream mapped contiguously instead */
+    if(region->mgr && region->mgr->mops->write_sg){
+        ret = sg_alloc_table_from_pages(&sgt, image->pages, image->n_pages, 0, image->len, GFP_KERNEL);
+        if (ret)
+            goto out_free_info;
+        info->sgt = &sgt;
+    } else {
+        buf = vmap(image->pages, image->n_pages, VM_MAP, PAGE_KERNEL);
+        if (!buf){
+            ret = -ENOMEM;
+            goto out_free_info;
+        }
+        info->buf = buf;
+        info->count = image->len;
+    }
+
+    if(req->flags & UCUBE_PROGRAM_PARTIAL)
+        info->flags |= FPGA_MGR_PARTIAL_RECONFIG;
+    region->info = info;
+    ret = fpga_region_program_fpga(region);
+    programmed = true;
+
+    if (ret)
+        pr_err("%s: Programming failed with error %d\n", __func__, ret);
+
+    region->info = NULL;
+    if(buf)
+        vunmap(buf);
+    else
+        sg_free_table(&sgt);
+out_free_info:
+    fpga_image_info_free(info);
+out_put:
+    put_device(&region->dev);
+out_unlock:
+    /* The upload is consumed once it has been handed to the manager, a
+     * request that never got that far puts it back for the client to retry
+     * unless a new upload has been started in the meantime */
+    if(!req->handle){
+        if(!programmed && !dev_data->bitstream.n_pages && !dev_data->bitstream.decomp && !dev_data->bitstream.head_len)
+            dev_data->bitstream = dev_data->program_image;
+        else
+            ucube_bitstream_free(&dev_data->program_image);
+        memset(&dev_data->program_image, 0, sizeof(dev_data->program_image));
+    }
+    mutex_unlock(&dev_data->bitstream_lock);
+
+    trace_ucube_program_end(req->region, ret, ktime_get_ns() - start);
+    return ret;
+}
+
+
+/* Adds count to the eventfds registered for event by any open file */
+static void ucube_signal_event(struct scope_device_data *dev_data, int event, u64 count){
+    struct ucube_file_data *file_data;
+    unsigned long flags;
+
+    if(!count)
+        return;
+    spin_lock_irqsave(&dev_data->event_lock, flags);
+    list_for_each_entry(file_data, &dev_data->event_files, event_node)
+        if(file_data->events[event])
+            eventfd_signal(file_data->events[event], count);
+    spin_unlock_irqrestore(&dev_data->event_lock, flags);
+}
+
+static long ucube_register_eventfd(struct ucube_file_data *file_data, void __user *arg){
+    struct scope_device_data *dev_data = file_data->dev_data;
+    struct ucube_eventfd_request req;
+    struct eventfd_ctx *ctx = NULL, *old;
+    unsigned long flags;
+    int i;
+
+    if(copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if(req.event >= UCUBE_N_EVENTS)
+        return -EINVAL;
+    if(req.fd >= 0){
+        ctx = eventfd_ctx_fdget(req.fd);
+        if(IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    spin_lock_irqsave(&dev_data->event_lock, flags);
+    old = file_data->events[req.event];
+    file_data->events[req.event] = ctx;
+    for(i = 0; i < UCUBE_N_EVENTS; i++)
+        if(file_data->events[i])
+            break;
+    if(i == UCUBE_N_EVENTS)
+        list_del_init(&file_data->event_node);
+    else if(list_empty(&file_data->event_node))
+        list_add(&file_data->event_node, &dev_data->event_files);
+    spin_unlock_irqrestore(&dev_data->event_lock, flags);
+
+    if(old)
+        eventfd_ctx_put(old);
+    return 0;
+}
+
+/* Marks the start of a programming run, only one can be in flight */
+static int ucube_program_begin(struct scope_device_data *dev_data){
+    int rc = 0;
+
+    spin_lock(&dev_data->program_state_lock);
+    if(dev_data->dead)
+        rc = -ENODEV;
+    else if(dev_data->program_state == UCUBE_FPGA_PROGRAMMING)
+        rc = -EBUSY;
+    else
+        dev_data->program_state = UCUBE_FPGA_PROGRAMMING;
+    spin_unlock(&dev_data->program_state_lock);
+    return rc;
+}
+
+static void ucube_program_end(struct scope_device_data *dev_data, int result){
+    spin_lock(&dev_data->program_state_lock);
+    dev_data->program_result = result;
+    dev_data->program_state = result ? UCUBE_FPGA_FAILED : UCUBE_FPGA_IDLE;
+    dev_data->program_count++;
+    spin_unlock(&dev_data->program_state_lock);
+    wake_up_interruptible(&dev_data->program_wq);
+    ucube_signal_event(dev_data, result ? UCUBE_EVENT_PROGRAM_ERROR : UCUBE_EVENT_PROGRAMMED, 1);
+}
+
+/* Moves the staged upload into the programming request, so that writes,
+ * truncation and IOCTL_STORE_BITSTREAM after submission leave it alone */
+static int ucube_program_take(struct scope_device_data *dev_data){
+    int rc;
+
+    mutex_lock(&dev_data->bitstream_lock);
+    rc = ucube_decomp_finish(&dev_data->bitstream);
+    if(!rc && !dev_data->bitstream.len)
+        rc = -EINVAL;
+    if(!rc){
+        dev_data->program_image = dev_data->bitstream;
+        memset(&dev_data->bitstream, 0, sizeof(dev_data->bitstream));
+    }
+    mutex_unlock(&dev_data->bitstream_lock);
+    return rc;
+}
+
+/* Runs a programming request inline or hands it to the unbound workqueue */
+static long ucube_program_submit(struct scope_device_data *dev_data, const struct ucube_program_request *req){
+    int rc;
+
+    if(req->region >= dev_data->n_fpga_regions)
+        return -EINVAL;
+
+    rc = ucube_program_begin(dev_data);
+    if(rc)
+        return rc;
+
+    if(!req->handle){
+        rc = ucube_program_take(dev_data);
+        if(rc){
+            ucube_program_end(dev_data, rc);
+            return rc;
+        }
+    }
+
+    if(req->flags & UCUBE_PROGRAM_ASYNC){
+        /* The work may still be pending when the instance is removed and
+         * its last file closed, so it holds a reference of its own */
+        dev_data->program_req = *req;
+        kref_get(&dev_data->ref);
+        queue_work(system_unbound_wq, &dev_data->program_work);
+        return 0;
+    }
+
+    rc = ucube_program_fpga(dev_data, req);
+    ucube_program_end(dev_data, rc);
+    return rc;
+}
+
+static void ucube_program_work(struct work_struct *work){
+    struct scope_device_data *dev_data = container_of(work, struct scope_device_data, program_work);
+
+    ucube_program_end(dev_data, ucube_program_fpga(dev_data, &dev_data->program_req));
+    kref_put(&dev_data->ref, ucube_release_instance);
+}
+
+bool ucube_fpga_loaded(struct scope_device_data *dev_data){
+    
+    struct fpga_region *region;
+    struct fpga_manager *mgr;
+    region = fpga_region_class_find(NULL, dev_data->fpga_nodes[0], device_match_of_node);
+    if (!region) {
+        pr_err("%s: FPGA region not found\n", __func__);
+        return false;
+    }
+    
+    // Get the FPGA manager from the region
+    mgr = region->mgr;
+    if (!mgr) {
+        put_device(&region->dev);
+        pr_err("%s: FPGA manager not found\n", __func__);
+        return false;
+    }
+
+    put_device(&region->dev);
+
+    return mgr->state == FPGA_MGR_STATE_OPERATING;
+}
+
+/* In cached mode the DMA buffer is cacheable memory owned by the device
+ * except while the interrupt thread copies a frame out of it */
+static void *ucube_dma_alloc(struct scope_device_data *dev_data, size_t size, bool cached, dma_addr_t *physaddr){
+    if(cached)
+        return dma_alloc_noncoherent(dev_data->dev, size, physaddr, DMA_FROM_DEVICE, GFP_KERNEL);
+    return dma_alloc_coherent(dev_data->dev, size, physaddr, GFP_KERNEL);
+}
+
+static void ucube_dma_free(struct scope_device_data *dev_data, void *buffer, size_t size, bool cached, dma_addr_t physaddr){
+    if(!buffer) return;
+
+    if(cached){
+        dma_free_noncoherent(dev_data->dev, size, buffer, physaddr, DMA_FROM_DEVICE);
+    } else {
+        dma_free_coherent(dev_data->dev, size, buffer, physaddr);
+    }
+}
+
+static int ucube_alloc_dma_buffer(struct scope_device_data *dev_data){
+    dev_data->dma_word_size = dev_data->is_zynqmp ? sizeof(u64) : sizeof(u32);
+    dev_data->dma_buffer = ucube_dma_alloc(dev_data, dev_data->dma_buf_size, dev_data->dma_cached, &dev_data->physaddr);
+    if(!dev_data->dma_buffer) return -ENOMEM;
+    return 0;
+}
+
+static void ucube_free_dma_buffer(struct scope_device_data *dev_data){
+    ucube_dma_free(dev_data, dev_data->dma_buffer, dev_data->dma_buf_size, dev_data->dma_cached, dev_data->physaddr);
+    dev_data->dma_buffer = NULL;
+}
+
+/* Builds an empty capture ring for frames of frame_size bytes, it only
+ * becomes visible once installed */
+static void *ucube_new_capture_area(u32 frame_size, u32 slots, size_t *size){
+    struct ucube_capture_header *header;
+    u32 stride = PAGE_ALIGN(frame_size);
+
+    *size = UCUBE_HEADER_SIZE + (size_t)slots * stride;
+    header = vmalloc_user(*size);
+    if(!header) return NULL;
+
+    header->data_offset = UCUBE_HEADER_SIZE;
+    header->slot_stride = stride;
+    header->n_slots = slots;
+    return header;
+}
+
+/* Replaces the capture ring and rewinds the readers and the trigger engine
+ * onto it. Called with capture_lock held for writing and the interrupt
+ * disabled, or before either can run */
+static void ucube_install_capture_area(struct scope_device_data *dev_data, void *area, size_t size){
+    struct ucube_capture_header *header = area;
+    struct ucube_file_data *reader;
+
+    vfree(dev_data->capture_area);
+    dev_data->capture_area = area;
+    dev_data->capture_area_size = size;
+    dev_data->capture_header = header;
+    dev_data->slot_stride = header->slot_stride;
+    dev_data->capture_slots = header->n_slots;
+    dev_data->write_slot = 0;
+    dev_data->capture_head = 0;
+
+    list_for_each_entry(reader, &dev_data->capture_readers, reader_node)
+        WRITE_ONCE(reader->read_tail, 0);
+
+    spin_lock(&dev_data->trigger_lock);
+    dev_data->trigger_events = 0;
+    dev_data->trigger_armed = false;
+    spin_unlock(&dev_data->trigger_lock);
+}
+
+static int ucube_alloc_capture_area(struct scope_device_data *dev_data){
+    size_t size;
+    void *area = ucube_new_capture_area(dev_data->dma_buf_size, dev_data->capture_slots, &size);
+
+    if(!area) return -ENOMEM;
+    ucube_install_capture_area(dev_data, area, size);
+    return 0;
+}
+
+static void ucube_free_capture_area(struct scope_device_data *dev_data){
+    vfree(dev_data->capture_area);
+    dev_data->capture_area = NULL;
+    dev_data->capture_header = NULL;
+}
+
+static void *ucube_slot_data(struct scope_device_data *dev_data, u32 slot){
+    return (u8 *)dev_data->capture_area + UCUBE_HEADER_SIZE + (size_t)slot * dev_data->slot_stride;
+}
+
+static ssize_t fclk_0_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    if(!dev_data->is_zynqmp){
+        unsigned long freq = clk_get_rate(dev_data->fclk[0]);
+        return sprintf(data, "%lu\n", freq);
+    } else {
+        return 0;
+    }
+}
+static ssize_t fclk_1_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    if(!dev_data->is_zynqmp){
+        unsigned long freq = clk_get_rate(dev_data->fclk[1]);
+        return sprintf(data, "%lu\n", freq);
+    } else {
+        return 0;
+    }
+}
+static ssize_t fclk_2_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    if(!dev_data->is_zynqmp){
+        unsigned long freq = clk_get_rate(dev_data->fclk[2]);
+        return sprintf(data, "%lu\n", freq);
+    } else {
+        return 0;
+    }
+}
+static ssize_t fclk_3_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    if(!dev_data->is_zynqmp){
+        unsigned long freq = clk_get_rate(dev_data->fclk[3]);
+        return sprintf(data, "%lu\n", freq);
+    } else {
+        return 0;
+    }
+}
+
+ssize_t fclk_0_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    if(!dev_data->is_zynqmp){
+        unsigned long freq;
+        if(kstrtoul(buf, 0, &freq))
+            return -EINVAL;
+        clk_set_rate(dev_data->fclk[0], freq);
+        return len;
+    } else {
+        return 0;
+    }
+}
+
+static ssize_t fclk_1_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    if(!dev_data->is_zynqmp){
+        unsigned long freq;
+        if(kstrtoul(buf, 0, &freq))
+            return -EINVAL;
+        clk_set_rate(dev_data->fclk[1], freq);
+        return len;
+    } else {
+        return 0;
+    }
+}
+
+static ssize_t fclk_2_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    if(!dev_data->is_zynqmp){
+        unsigned long freq;
+        if(kstrtoul(buf, 0, &freq))
+            return -EINVAL;
+        clk_set_rate(dev_data->fclk[2], freq);
+        return len;
+    } else {
+        return 0;
+    }
+}
+
+static ssize_t fclk_3_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    if(!dev_data->is_zynqmp){
+        unsigned long freq;
+        if(kstrtoul(buf, 0, &freq))
+            return -EINVAL;
+        clk_set_rate(dev_data->fclk[3], freq);
+        return len;
+    } else {
+        return 0;
+    }
+}
+
+static ssize_t dma_addr_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    #if defined(__arm__)
+    return sprintf(data, "%lu\n", dev_data->physaddr);
+    #elif defined(__aarch64__)
+    return sprintf(data, "%llu\n", dev_data->physaddr);
+    #else
+    printk(KERN_ALERT "Hello, kernel. Unknown mode!\n");
+    return 0
+    #endif
+}
+
+static ssize_t dma_addr_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+        return 0;
+}
+
+
+static ssize_t dma_buf_size_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%u\n", dev_data->dma_buf_size);
+}
+
+static ssize_t dma_buf_size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    unsigned long size;
+    void *buffer, *old_buffer, *area;
+    dma_addr_t physaddr, old_physaddr;
+    size_t area_size;
+    u32 old_size;
+    if(kstrtoul(buf, 0, &size))
+        return -EINVAL;
+    if(!size || size > U32_MAX || size % dev_data->dma_word_size)
+        return -EINVAL;
+    
+    pr_info("%s: Requested buffer size: %s\n", __func__, buf);
+
+    down_write(&dev_data->capture_lock);
+    if(atomic_read(&dev_data->capture_mappings)){
+        pr_err("%s: capture buffer is currently mapped by user space\n", __func__);
+        up_write(&dev_data->capture_lock);
+        return -EBUSY;
+    }
+
+    /* Both buffers are allocated before anything is torn down, a failure
+     * leaves the current ones in use */
+    buffer = ucube_dma_alloc(dev_data, size, dev_data->dma_cached, &physaddr);
+    if(!buffer){
+        pr_err("%s: Failed to allocate the dma buffer\n", __func__);
+        up_write(&dev_data->capture_lock);
+        return -ENOMEM;
+    }
+    area = ucube_new_capture_area(size, dev_data->capture_slots, &area_size);
+    if(!area){
+        pr_err("%s: Failed to allocate the capture buffer\n", __func__);
+        ucube_dma_free(dev_data, buffer, size, dev_data->dma_cached, physaddr);
+        up_write(&dev_data->capture_lock);
+        return -ENOMEM;
+    }
+
+    disable_irq(dev_data->irq);
+    old_buffer = dev_data->dma_buffer;
+    old_physaddr = dev_data->physaddr;
+    old_size = dev_data->dma_buf_size;
+    dev_data->dma_buffer = buffer;
+    dev_data->physaddr = physaddr;
+    dev_data->dma_buf_size = size;
+    ucube_install_capture_area(dev_data, area, area_size);
+    enable_irq(dev_data->irq);
+
+    ucube_dma_free(dev_data, old_buffer, old_size, dev_data->dma_cached, old_physaddr);
+    up_write(&dev_data->capture_lock);
+
+    return len;
+}
+
+static ssize_t dma_cached_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%d\n", dev_data->dma_cached);
+}
+
+static ssize_t dma_cached_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    bool cached;
+    void *buffer, *old_buffer;
+    dma_addr_t physaddr, old_physaddr;
+    if(kstrtobool(buf, &cached))
+        return -EINVAL;
+
+    down_write(&dev_data->capture_lock);
+    if(cached == dev_data->dma_cached){
+        up_write(&dev_data->capture_lock);
+        return len;
+    }
+
+    /* The buffer moves, user space has to reprogram the DMA with the new
+     * address from dma_addr. The old one stays in use if this fails */
+    buffer = ucube_dma_alloc(dev_data, dev_data->dma_buf_size, cached, &physaddr);
+    if(!buffer){
+        pr_err("%s: Failed to allocate the dma buffer\n", __func__);
+        up_write(&dev_data->capture_lock);
+        return -ENOMEM;
+    }
+
+    disable_irq(dev_data->irq);
+    old_buffer = dev_data->dma_buffer;
+    old_physaddr = dev_data->physaddr;
+    dev_data->dma_buffer = buffer;
+    dev_data->physaddr = physaddr;
+    dev_data->dma_cached = cached;
+    enable_irq(dev_data->irq);
+
+    ucube_dma_free(dev_data, old_buffer, dev_data->dma_buf_size, !cached, old_physaddr);
+    up_write(&dev_data->capture_lock);
+
+    return len;
+}
+
+static ssize_t dma_sync_count_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%llu\n", READ_ONCE(dev_data->dma_sync_count));
+}
+
+static ssize_t dma_sync_cpu_ns_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%llu\n", READ_ONCE(dev_data->dma_sync_cpu_ns));
+}
+
+static ssize_t dma_sync_device_ns_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%llu\n", READ_ONCE(dev_data->dma_sync_device_ns));
+}
+
+static ssize_t dma_sync_stats_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    dev_data->dma_sync_count = 0;
+    dev_data->dma_sync_cpu_ns = 0;
+    dev_data->dma_sync_device_ns = 0;
+    return len;
+}
+
+static ssize_t capture_slots_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%u\n", dev_data->capture_slots);
+}
+
+static ssize_t capture_slots_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    unsigned int slots;
+    size_t area_size;
+    void *area;
+    if(kstrtouint(buf, 0, &slots))
+        return -EINVAL;
+    if(slots == 0 || slots > UCUBE_MAX_CAPTURE_SLOTS)
+        return -EINVAL;
+
+    down_write(&dev_data->capture_lock);
+    if(atomic_read(&dev_data->capture_mappings)){
+        pr_err("%s: capture buffer is currently mapped by user space\n", __func__);
+        up_write(&dev_data->capture_lock);
+        return -EBUSY;
+    }
+
+    area = ucube_new_capture_area(dev_data->dma_buf_size, slots, &area_size);
+    if(!area){
+        pr_err("%s: Failed to allocate the capture buffer\n", __func__);
+        up_write(&dev_data->capture_lock);
+        return -ENOMEM;
+    }
+
+    disable_irq(dev_data->irq);
+    ucube_install_capture_area(dev_data, area, area_size);
+    enable_irq(dev_data->irq);
+    up_write(&dev_data->capture_lock);
+
+    return len;
+}
+
+static ssize_t sample_format_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%u\n", dev_data->sample_format);
+}
+
+static ssize_t sample_format_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    unsigned long format;
+    if(kstrtoul(buf, 0, &format) || format > UCUBE_FORMAT_S24)
+        return -EINVAL;
+
+    down_write(&dev_data->capture_lock);
+    disable_irq(dev_data->irq);
+    dev_data->sample_format = format;
+    enable_irq(dev_data->irq);
+    up_write(&dev_data->capture_lock);
+    return len;
+}
+
+static ssize_t coalesce_rate_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%u\n", READ_ONCE(dev_data->coalesce_rate));
+}
+
+static ssize_t coalesce_rate_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    unsigned int rate;
+    if(kstrtouint(buf, 0, &rate))
+        return -EINVAL;
+    WRITE_ONCE(dev_data->coalesce_rate, rate);
+    return len;
+}
+
+static ssize_t coalesce_batch_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%u\n", READ_ONCE(dev_data->coalesce_batch));
+}
+
+static ssize_t coalesce_batch_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    unsigned int batch;
+    if(kstrtouint(buf, 0, &batch) || !batch)
+        return -EINVAL;
+    WRITE_ONCE(dev_data->coalesce_batch, batch);
+    return len;
+}
+
+static ssize_t coalesce_timeout_us_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%u\n", READ_ONCE(dev_data->coalesce_timeout_us));
+}
+
+static ssize_t coalesce_timeout_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    unsigned int timeout;
+    if(kstrtouint(buf, 0, &timeout) || !timeout)
+        return -EINVAL;
+    WRITE_ONCE(dev_data->coalesce_timeout_us, timeout);
+    return len;
+}
+
+/* Time spent delivering per frame and coalesced, in ns, and the current mode */
+static ssize_t coalesce_time_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    bool coalescing = READ_ONCE(dev_data->coalescing);
+    u64 time[2] = { READ_ONCE(dev_data->coalesce_time_ns[0]), READ_ONCE(dev_data->coalesce_time_ns[1]) };
+
+    time[coalescing] += ktime_get_ns() - READ_ONCE(dev_data->coalesce_since);
+    return sprintf(data, "%llu %llu %d\n", time[0], time[1], coalescing);
+}
+
+static ssize_t coalesce_time_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+        return 0;
+}
+
+static ssize_t trigger_events_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%llu\n", READ_ONCE(dev_data->trigger_events));
+}
+
+static ssize_t trigger_events_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+        return 0;
+}
+
+static ssize_t torn_reads_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%llu\n", READ_ONCE(dev_data->torn_reads));
+}
+
+static ssize_t torn_reads_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+        return 0;
+}
+
+static ssize_t missed_frames_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%llu\n", READ_ONCE(dev_data->missed_frames));
+}
+
+static ssize_t missed_frames_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+        return 0;
+}
+
+static ssize_t irq_affinity_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%d\n", dev_data->irq_cpu);
+}
+
+static int ucube_set_irq_affinity(struct scope_device_data *dev_data, int cpu){
+    if(cpu < 0)
+        return irq_set_affinity_hint(dev_data->irq, NULL);
+    if(cpu >= nr_cpu_ids || !cpu_online(cpu))
+        return -EINVAL;
+    return irq_set_affinity_hint(dev_data->irq, cpumask_of(cpu));
+}
+
+static ssize_t irq_affinity_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    int cpu, rc;
+    if(kstrtoint(buf, 0, &cpu))
+        return -EINVAL;
+
+    rc = ucube_set_irq_affinity(dev_data, cpu);
+    if(rc)
+        return rc;
+    dev_data->irq_cpu = cpu < 0 ? -1 : cpu;
+    return len;
+}
+
+static ssize_t irq_thread_prio_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%u\n", dev_data->irq_thread_prio);
+}
+
+static ssize_t irq_thread_prio_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    unsigned int prio;
+    if(kstrtouint(buf, 0, &prio))
+        return -EINVAL;
+    if(prio == 0 || prio >= MAX_RT_PRIO)
+        return -EINVAL;
+
+    /* Only the thread itself can change its policy, the new priority is
+     * picked up when the next frame is handled */
+    dev_data->irq_thread_prio = prio;
+    atomic_set(&dev_data->irq_thread_prio_changed, 1);
+    return len;
+}
+
+static ssize_t bitstream_cache_size_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%zu\n", dev_data->bitstream_cache_limit);
+}
+
+static ssize_t bitstream_cache_size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    unsigned long size;
+    if(kstrtoul(buf, 0, &size))
+        return -EINVAL;
+
+    mutex_lock(&dev_data->bitstream_lock);
+    dev_data->bitstream_cache_limit = size;
+    ucube_cache_trim(dev_data);
+    mutex_unlock(&dev_data->bitstream_lock);
+    return len;
+}
+
+static ssize_t bitstream_cache_usage_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%zu\n", READ_ONCE(dev_data->bitstream_cache_bytes));
+}
+
+static ssize_t bitstream_cache_entries_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%u\n", READ_ONCE(dev_data->bitstream_cache_entries));
+}
+
+static ssize_t bitstream_cache_hits_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%llu\n", READ_ONCE(dev_data->bitstream_cache_hits));
+}
+
+static ssize_t bitstream_cache_misses_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    return sprintf(data, "%llu\n", READ_ONCE(dev_data->bitstream_cache_misses));
+}
+
+static ssize_t bitstream_cache_stats_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+        return 0;
+}
+
+static ssize_t fpga_regions_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    for(unsigned int i = 0; i < dev_data->n_fpga_regions; i++)
+        len += sysfs_emit_at(data, len, "%u %pOF\n", i, dev_data->fpga_nodes[i]);
+    return len;
+}
+
+static ssize_t fpga_regions_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+        return 0;
+}
+
+static ssize_t overruns_show(struct device *dev, struct device_attribute *mattr, char *data) {
+    struct scope_device_data *dev_data = dev_get_drvdata(dev);
+    u64 overruns;
+
+    /* the header is freed along with the capture area on a resize */
+    down_read(&dev_data->capture_lock);
+    overruns = READ_ONCE(dev_data->capture_header->overruns);
+    up_read(&dev_data->capture_lock);
+    return sprintf(data, "%llu\n", overruns);
+}
+
+static ssize_t overruns_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t len) {
+        return 0;
+}
+
+static DEVICE_ATTR(fclk_0, S_IRUGO|S_IWUSR, fclk_0_show, fclk_0_store);
+static DEVICE_ATTR(fclk_1, S_IRUGO|S_IWUSR, fclk_1_show, fclk_1_store);
+static DEVICE_ATTR(fclk_2, S_IRUGO|S_IWUSR, fclk_2_show, fclk_2_store);
 static DEVICE_ATTR(fclk_3, S_IRUGO|S_IWUSR, fclk_3_show, fclk_3_store);
 static DEVICE_ATTR(dma_addr, S_IRUGO, dma_addr_show, dma_addr_store);
 static DEVICE_ATTR(dma_buf_size, S_IRUGO|S_IWUSR, dma_buf_size_show, dma_buf_size_store);
+static DEVICE_ATTR(dma_cached, S_IRUGO|S_IWUSR, dma_cached_show, dma_cached_store);
+static DEVICE_ATTR(dma_sync_count, S_IRUGO|S_IWUSR, dma_sync_count_show, dma_sync_stats_store);
+static DEVICE_ATTR(dma_sync_cpu_ns, S_IRUGO|S_IWUSR, dma_sync_cpu_ns_show, dma_sync_stats_store);
+static DEVICE_ATTR(dma_sync_device_ns, S_IRUGO|S_IWUSR, dma_sync_device_ns_show, dma_sync_stats_store);
+static DEVICE_ATTR(capture_slots, S_IRUGO|S_IWUSR, capture_slots_show, capture_slots_store);
+static DEVICE_ATTR(overruns, S_IRUGO, overruns_show, overruns_store);
+static DEVICE_ATTR(fpga_regions, S_IRUGO, fpga_regions_show, fpga_regions_store);
+static DEVICE_ATTR(bitstream_cache_size, S_IRUGO|S_IWUSR, bitstream_cache_size_show, bitstream_cache_size_store);
+static DEVICE_ATTR(bitstream_cache_usage, S_IRUGO, bitstream_cache_usage_show, bitstream_cache_stats_store);
+static DEVICE_ATTR(bitstream_cache_entries, S_IRUGO, bitstream_cache_entries_show, bitstream_cache_stats_store);
+static DEVICE_ATTR(bitstream_cache_hits, S_IRUGO, bitstream_cache_hits_show, bitstream_cache_stats_store);
+static DEVICE_ATTR(bitstream_cache_misses, S_IRUGO, bitstream_cache_misses_show, bitstream_cache_stats_store);
+static DEVICE_ATTR(missed_frames, S_IRUGO, missed_frames_show, missed_frames_store);
+static DEVICE_ATTR(torn_reads, S_IRUGO, torn_reads_show, torn_reads_store);
+static DEVICE_ATTR(trigger_events, S_IRUGO, trigger_events_show, trigger_events_store);
+static DEVICE_ATTR(coalesce_rate, S_IRUGO|S_IWUSR, coalesce_rate_show, coalesce_rate_store);
+static DEVICE_ATTR(coalesce_batch, S_IRUGO|S_IWUSR, coalesce_batch_show, coalesce_batch_store);
+static DEVICE_ATTR(coalesce_timeout_us, S_IRUGO|S_IWUSR, coalesce_timeout_us_show, coalesce_timeout_us_store);
+static DEVICE_ATTR(coalesce_time, S_IRUGO, coalesce_time_show, coalesce_time_store);
+static DEVICE_ATTR(sample_format, S_IRUGO|S_IWUSR, sample_format_show, sample_format_store);
+static DEVICE_ATTR(irq_affinity, S_IRUGO|S_IWUSR, irq_affinity_show, irq_affinity_store);
+static DEVICE_ATTR(irq_thread_prio, S_IRUGO|S_IWUSR, irq_thread_prio_show, irq_thread_prio_store);
 
 static struct attribute *uscope_lkm_attrs[] = {
 	&dev_attr_fclk_0.attr,
@@ -332,6 +1846,28 @@ static struct attribute *uscope_lkm_attrs[] = {
 	&dev_attr_fclk_3.attr,
 	&dev_attr_dma_addr.attr,
 	&dev_attr_dma_buf_size.attr,
+	&dev_attr_dma_cached.attr,
+	&dev_attr_dma_sync_count.attr,
+	&dev_attr_dma_sync_cpu_ns.attr,
+	&dev_attr_dma_sync_device_ns.attr,
+	&dev_attr_capture_slots.attr,
+	&dev_attr_overruns.attr,
+	&dev_attr_fpga_regions.attr,
+	&dev_attr_bitstream_cache_size.attr,
+	&dev_attr_bitstream_cache_usage.attr,
+	&dev_attr_bitstream_cache_entries.attr,
+	&dev_attr_bitstream_cache_hits.attr,
+	&dev_attr_bitstream_cache_misses.attr,
+	&dev_attr_missed_frames.attr,
+	&dev_attr_torn_reads.attr,
+	&dev_attr_trigger_events.attr,
+	&dev_attr_coalesce_rate.attr,
+	&dev_attr_coalesce_batch.attr,
+	&dev_attr_coalesce_timeout_us.attr,
+	&dev_attr_coalesce_time.attr,
+	&dev_attr_sample_format.attr,
+	&dev_attr_irq_affinity.attr,
+	&dev_attr_irq_thread_prio.attr,
 	NULL,
 };
 
@@ -339,50 +1875,590 @@ const struct attribute_group uscope_lkm_attr_group = {
 	.attrs = uscope_lkm_attrs,
 };
 
-static struct of_device_id ucube_lkm_match_table[] = {
-     {.compatible = "ucube_lkm"},
-     {}
-};
+static struct of_device_id ucube_lkm_match_table[] = {
+     {.compatible = "ucube_lkm"},
+     {}
+};
+
+static struct platform_driver ucube_lkm_platform_driver = {
+        .probe = ucube_lkm_probe,
+        .remove = ucube_lkm_remove,
+        .driver = {
+                .name = "ucube_lkm",
+                .owner = THIS_MODULE,
+                .of_match_table = of_match_ptr(ucube_lkm_match_table),
+        },
+};
+
+
+/* Latencies are binned by power of two: bucket n counts values in
+ * [2^(n-1), 2^n) ns and the last bucket everything above */
+static void ucube_hist_add(u64 *hist, u64 ns){
+    hist[min(fls64(ns), UCUBE_HIST_BUCKETS - 1)]++;
+}
+
+static int ucube_hist_show(struct seq_file *m, void *v){
+    u64 *hist = m->private;
+
+    for(int i = 0; i < UCUBE_HIST_BUCKETS; i++){
+        u64 count = READ_ONCE(hist[i]);
+        if(!count)
+            continue;
+        seq_printf(m, "%llu-%llu %llu\n", i ? 1ULL << (i - 1) : 0ULL, 1ULL << i, count);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ucube_hist);
+
+/* The hard interrupt handler only timestamps the frame, the copy out of the
+ * DMA buffer is left to the interrupt thread */
+static irqreturn_t ucube_lkm_irq(int irq, void *dev_id)  {
+    struct scope_device_data *dev_data = dev_id;
+    u64 timestamp = ktime_get_ns();
+
+    trace_ucube_irq(timestamp);
+    WRITE_ONCE(dev_data->irq_timestamp, timestamp);
+    atomic_inc(&dev_data->irq_pending);
+    return IRQ_WAKE_THREAD;
+}
+
+static void ucube_apply_irq_thread_prio(struct scope_device_data *dev_data){
+    struct sched_attr attr = {
+        .size = sizeof(attr),
+        .sched_policy = SCHED_FIFO,
+        .sched_priority = dev_data->irq_thread_prio,
+    };
+
+    if(sched_setattr_nocheck(current, &attr))
+        pr_err("%s: Failed to set interrupt thread priority to %u\n", __func__, dev_data->irq_thread_prio);
+}
+
+static u32 ucube_sample_width(struct scope_device_data *dev_data, u32 format){
+    switch(format){
+    case UCUBE_FORMAT_S16:
+        return 2;
+    case UCUBE_FORMAT_S24:
+        return 3;
+    default:
+        return dev_data->dma_word_size;
+    }
+}
+
+/* Samples are decoded by their width alone: 2 and 3 bytes for the packed
+ * formats, 4 and 8 for raw Zynq and ZynqMP bus words */
+static s64 ucube_load_sample(const u8 *p, u32 width){
+    switch(width){
+    case 2:
+        return (s16)get_unaligned_le16(p);
+    case 3:
+        return sign_extend32(p[0] | p[1] << 8 | p[2] << 16, 23);
+    case 4:
+        return (s32)get_unaligned_le32(p);
+    default:
+        return (s64)get_unaligned_le64(p);
+    }
+}
+
+static void ucube_store_sample(u8 *p, s64 value, u32 width){
+    switch(width){
+    case 2:
+        put_unaligned_le16(value, p);
+        break;
+    case 3:
+        p[0] = value;
+        p[1] = value >> 8;
+        p[2] = value >> 16;
+        break;
+    case 4:
+        put_unaligned_le32(value, p);
+        break;
+    default:
+        put_unaligned_le64(value, p);
+        break;
+    }
+}
+
+/* Copies the DMA buffer into a slot in the selected sample format and returns
+ * the bytes stored. One loop per source word size keeps the packing loops
+ * free of per-sample branches. */
+static size_t ucube_pack_frame(struct scope_device_data *dev_data, u8 *dst, struct ucube_slot_header *slot){
+    u32 format = dev_data->sample_format;
+    u32 width = ucube_sample_width(dev_data, format);
+    size_t n_words = dev_data->dma_buf_size / dev_data->dma_word_size;
+    const u32 *src32 = dev_data->dma_buffer;
+    const u64 *src64 = dev_data->dma_buffer;
+    bool word64 = dev_data->dma_word_size == sizeof(u64);
+    size_t i;
+
+    slot->format = format;
+    slot->sample_width = width;
+    for(i = 0; i < N_SCOPE_CHANNELS; i++){
+        if(format == UCUBE_FORMAT_RAW || i >= n_words)
+            slot->channel_tags[i] = 0;
+        else
+            slot->channel_tags[i] = (word64 ? src64[i] : src32[i]) >> (8 * width);
+    }
+
+    if(format == UCUBE_FORMAT_RAW){
+        memcpy(dst, dev_data->dma_buffer, dev_data->dma_buf_size);
+        return dev_data->dma_buf_size;
+    }
+
+    if(format == UCUBE_FORMAT_S16){
+        u16 *dst16 = (u16 *)dst;
+        if(word64){
+            for(i = 0; i < n_words; i++)
+                dst16[i] = src64[i];
+        } else {
+            for(i = 0; i < n_words; i++)
+                dst16[i] = src32[i];
+        }
+    } else {
+        if(word64){
+            for(i = 0; i < n_words; i++)
+                ucube_store_sample(dst + 3 * i, src64[i], 3);
+        } else {
+            for(i = 0; i < n_words; i++)
+                ucube_store_sample(dst + 3 * i, src32[i], 3);
+        }
+    }
+    return n_words * width;
+}
+
+/* Runs the trigger over the frame just stored in slot and opens or extends
+ * the delivery window around a hit. Returns true if the frame falls in a
+ * window, so that triggered readers need waking. */
+static bool ucube_trigger_frame(struct scope_device_data *dev_data, u64 frame, const u8 *data, const struct ucube_slot_header *slot){
+    struct ucube_trigger_config *cfg = &dev_data->trigger;
+    struct ucube_trigger_window *window = NULL;
+    u32 width = slot->sample_width;
+    size_t n_samples = slot->length / (N_SCOPE_CHANNELS * width);
+    u32 pre;
+    bool hit = false, deliver;
+    s64 value, prev;
+    u64 n;
+
+    spin_lock(&dev_data->trigger_lock);
+    prev = dev_data->trigger_prev;
+    n = dev_data->trigger_events;
+    if(n)
+        window = &dev_data->trigger_windows[(n - 1) % UCUBE_TRIGGER_WINDOWS];
+
+    if(cfg->mode != UCUBE_TRIGGER_OFF && n_samples){
+        for(size_t i = 0; i < n_samples && !hit; i++){
+            value = ucube_load_sample(data + (i * N_SCOPE_CHANNELS + cfg->channel) * width, width);
+            switch(cfg->mode){
+            case UCUBE_TRIGGER_LEVEL:
+                hit = value >= cfg->level;
+                break;
+            case UCUBE_TRIGGER_RISING:
+                hit = dev_data->trigger_armed && prev < cfg->level && value >= cfg->level;
+                break;
+            case UCUBE_TRIGGER_FALLING:
+                hit = dev_data->trigger_armed && prev > cfg->level && value <= cfg->level;
+                break;
+            case UCUBE_TRIGGER_WINDOW:
+                hit = value < cfg->level || value > cfg->level_high;
+                break;
+            }
+            prev = value;
+            dev_data->trigger_armed = true;
+        }
+        dev_data->trigger_prev = ucube_load_sample(data + ((n_samples - 1) * N_SCOPE_CHANNELS + cfg->channel) * width, width);
+    }
+
+    if(hit){
+        if(window && frame <= window->end){
+            window->end = max(window->end, frame + cfg->post_frames + 1);
+        } else {
+            pre = min(cfg->pre_frames, dev_data->capture_slots - 1);
+            window = &dev_data->trigger_windows[n % UCUBE_TRIGGER_WINDOWS];
+            window->start = frame > pre ? frame - pre : 0;
+            if(n)
+                window->start = max(window->start, dev_data->trigger_windows[(n - 1) % UCUBE_TRIGGER_WINDOWS].end);
+            window->end = frame + cfg->post_frames + 1;
+            dev_data->trigger_events = n + 1;
+        }
+    }
+    deliver = window && window->end > frame;
+    spin_unlock(&dev_data->trigger_lock);
+    return deliver;
+}
+
+static int ucube_set_trigger(struct scope_device_data *dev_data, const struct ucube_trigger_config *cfg){
+    if(cfg->mode > UCUBE_TRIGGER_WINDOW || cfg->channel >= N_SCOPE_CHANNELS)
+        return -EINVAL;
+    if(cfg->mode == UCUBE_TRIGGER_WINDOW && cfg->level_high < cfg->level)
+        return -EINVAL;
+
+    spin_lock(&dev_data->trigger_lock);
+    dev_data->trigger = *cfg;
+    dev_data->trigger_armed = false;
+    spin_unlock(&dev_data->trigger_lock);
+    return 0;
+}
+
+/* Wakes the readers for the frames published since the last wakeup */
+static void ucube_wake_readers(struct scope_device_data *dev_data, int frames){
+    trace_ucube_wakeup(smp_load_acquire(&dev_data->capture_head));
+    ucube_signal_event(dev_data, UCUBE_EVENT_FRAME, frames);
+    wake_up_interruptible_poll(&dev_data->capture_wq, POLLIN | POLLRDNORM);
+    if(atomic_xchg(&dev_data->trigger_wake_pending, 0))
+        wake_up_interruptible_poll(&dev_data->trigger_wq, POLLIN | POLLRDNORM);
+}
+
+/* Flushes the wakeups batched up in coalescing mode once the oldest of them
+ * has waited coalesce_timeout_us */
+static enum hrtimer_restart ucube_coalesce_flush(struct hrtimer *timer){
+    struct scope_device_data *dev_data = container_of(timer, struct scope_device_data, coalesce_timer);
+    int frames = atomic_xchg(&dev_data->coalesce_pending, 0);
+
+    if(frames)
+        ucube_wake_readers(dev_data, frames);
+    return HRTIMER_NORESTART;
+}
+
+/* Every frame still has to be copied out of the DMA buffer before the next
+ * one lands, and the fabric exposes no completion status that could be
+ * polled instead, so the interrupt itself cannot be masked. What is batched
+ * above coalesce_rate is the wakeup of the readers, which dominates the cost
+ * per frame once several of them are waiting. The frame rate is tracked as
+ * a moving average of the interval between interrupts, with some hysteresis
+ * on the way back to per-frame wakeups. */
+static void ucube_coalesce_update(struct scope_device_data *dev_data, int frames){
+    u64 now = READ_ONCE(dev_data->irq_timestamp);
+    u64 interval, threshold;
+    u32 rate = READ_ONCE(dev_data->coalesce_rate);
+    bool coalesce;
+    int flushed;
+
+    if(dev_data->coalesce_last_irq){
+        interval = div_u64(now - dev_data->coalesce_last_irq, frames);
+        if(!dev_data->coalesce_interval_ns)
+            dev_data->coalesce_interval_ns = interval;
+        else
+            dev_data->coalesce_interval_ns += div_s64((s64)interval - (s64)dev_data->coalesce_interval_ns, 8);
+    }
+    dev_data->coalesce_last_irq = now;
+
+    if(!rate){
+        coalesce = false;
+    } else {
+        threshold = div_u64(NSEC_PER_SEC, rate);
+        if(dev_data->coalescing)
+            coalesce = dev_data->coalesce_interval_ns < threshold + threshold / 4;
+        else
+            coalesce = dev_data->coalesce_interval_ns && dev_data->coalesce_interval_ns < threshold;
+    }
+
+    if(coalesce != dev_data->coalescing){
+        dev_data->coalesce_time_ns[dev_data->coalescing] += now - dev_data->coalesce_since;
+        dev_data->coalesce_since = now;
+        WRITE_ONCE(dev_data->coalescing, coalesce);
+        if(!coalesce){
+            hrtimer_try_to_cancel(&dev_data->coalesce_timer);
+            flushed = atomic_xchg(&dev_data->coalesce_pending, 0);
+            if(flushed)
+                ucube_wake_readers(dev_data, flushed);
+        }
+    }
+}
+
+static irqreturn_t ucube_lkm_irq_thread(int irq, void *dev_id)  {
+    struct scope_device_data *dev_data = dev_id;
+    struct ucube_capture_header *header = dev_data->capture_header;
+    struct ucube_slot_header *slot = &header->slots[dev_data->write_slot];
+    void *slot_data = ucube_slot_data(dev_data, dev_data->write_slot);
+    u64 head = dev_data->capture_head;
+    u64 sync_start, copy_start, copy_time;
+    size_t length;
+    bool deliver;
+    int pending, frames;
+
+    if(atomic_xchg(&dev_data->irq_thread_prio_changed, 0))
+        ucube_apply_irq_thread_prio(dev_data);
+
+    /* The DMA buffer only holds the most recent frame, any earlier one
+     * signalled since the last run has already been overwritten */
+    pending = atomic_xchg(&dev_data->irq_pending, 0);
+    if(!pending)
+        return IRQ_HANDLED;
+    dev_data->missed_frames += pending - 1;
+    ucube_signal_event(dev_data, UCUBE_EVENT_OVERRUN, pending - 1);
+
+    if(dev_data->dma_cached){
+        sync_start = ktime_get_ns();
+        dma_sync_single_for_cpu(dev_data->dev, dev_data->physaddr, dev_data->dma_buf_size, DMA_FROM_DEVICE);
+        dev_data->dma_sync_cpu_ns += ktime_get_ns() - sync_start;
+    }
+
+    WRITE_ONCE(slot->lock, slot->lock + 1);
+    smp_wmb();
+    trace_ucube_copy_start(head, dev_data->write_slot, dev_data->dma_buf_size, pending);
+    copy_start = ktime_get_ns();
+    length = ucube_pack_frame(dev_data, slot_data, slot);
+    copy_time = ktime_get_ns() - copy_start;
+    ucube_hist_add(dev_data->copy_time_hist, copy_time);
+    trace_ucube_copy_end(head, copy_time);
+
+    if(dev_data->dma_cached){
+        sync_start = ktime_get_ns();
+        dma_sync_single_for_device(dev_data->dev, dev_data->physaddr, dev_data->dma_buf_size, DMA_FROM_DEVICE);
+        dev_data->dma_sync_device_ns += ktime_get_ns() - sync_start;
+        dev_data->dma_sync_count++;
+    }
+    slot->length = length;
+    slot->sequence = head;
+    slot->timestamp = READ_ONCE(dev_data->irq_timestamp);
+    slot->dropped = dev_data->missed_frames;
+    smp_wmb();
+    WRITE_ONCE(slot->lock, slot->lock + 1);
+
+    deliver = ucube_trigger_frame(dev_data, head, slot_data, slot);
+
+    smp_store_release(&header->head, head + 1);
+    smp_store_release(&dev_data->capture_head, head + 1);
+    if(++dev_data->write_slot == dev_data->capture_slots)
+        dev_data->write_slot = 0;
+
+    if(deliver)
+        atomic_set(&dev_data->trigger_wake_pending, 1);
+    ucube_coalesce_update(dev_data, pending);
+    if(!dev_data->coalescing){
+        ucube_wake_readers(dev_data, 1);
+    } else if(atomic_inc_return(&dev_data->coalesce_pending) >= READ_ONCE(dev_data->coalesce_batch)){
+        hrtimer_try_to_cancel(&dev_data->coalesce_timer);
+        frames = atomic_xchg(&dev_data->coalesce_pending, 0);
+        if(frames)
+            ucube_wake_readers(dev_data, frames);
+    } else if(!hrtimer_active(&dev_data->coalesce_timer)){
+        hrtimer_start(&dev_data->coalesce_timer, ns_to_ktime((u64)READ_ONCE(dev_data->coalesce_timeout_us) * NSEC_PER_USEC), HRTIMER_MODE_REL);
+    }
+    return IRQ_RETVAL(1);
+}
+
+/* First frame at or after cursor that lies in a trigger window, U64_MAX if
+ * no window reaches past the cursor yet */
+static u64 ucube_trigger_next(struct scope_device_data *dev_data, u64 cursor){
+    struct ucube_trigger_window *window;
+    u64 next = U64_MAX;
+    u64 n;
+
+    spin_lock(&dev_data->trigger_lock);
+    n = dev_data->trigger_events;
+    for(u64 i = n > UCUBE_TRIGGER_WINDOWS ? n - UCUBE_TRIGGER_WINDOWS : 0; i < n; i++){
+        window = &dev_data->trigger_windows[i % UCUBE_TRIGGER_WINDOWS];
+        if(window->end > cursor){
+            next = max(cursor, window->start);
+            break;
+        }
+    }
+    spin_unlock(&dev_data->trigger_lock);
+    return next;
+}
+
+/* Next frame the file would read, frames outside trigger windows are passed
+ * over in triggered mode */
+static u64 ucube_next_frame(struct ucube_file_data *file_data){
+    struct scope_device_data *dev_data = file_data->dev_data;
+    u64 cursor = READ_ONCE(file_data->read_tail);
+
+    if(file_data->read_mode & UCUBE_READ_TRIGGERED)
+        return ucube_trigger_next(dev_data, cursor);
+    return cursor;
+}
+
+static bool ucube_frame_available(struct ucube_file_data *file_data){
+    struct scope_device_data *dev_data = file_data->dev_data;
+    return ucube_next_frame(file_data) < smp_load_acquire(&dev_data->capture_head);
+}
+
+static wait_queue_head_t *ucube_reader_wq(struct ucube_file_data *file_data){
+    struct scope_device_data *dev_data = file_data->dev_data;
+    if(file_data->read_mode & UCUBE_READ_TRIGGERED)
+        return &dev_data->trigger_wq;
+    return &dev_data->capture_wq;
+}
+
+
+static __poll_t ucube_lkm_poll(struct file *flip , struct poll_table_struct * poll_struct){
+    struct scope_device_data *dev_data = ucube_file_dev(flip);
+    int minor = ucube_minor(flip->f_inode);
+    if(READ_ONCE(dev_data->dead))
+        return POLLERR | POLLHUP;
+    if(minor == 0){
+        __poll_t mask = 0;
+        poll_wait(flip, ucube_reader_wq(flip->private_data), poll_struct);
+        if(ucube_frame_available(flip->private_data))
+            mask |= POLLIN | POLLRDNORM;
+        return mask;
+    } else if(minor == 3){
+        struct ucube_file_data *file_data = flip->private_data;
+        __poll_t mask = 0;
+        poll_wait(flip, &dev_data->program_wq, poll_struct);
+        if(READ_ONCE(dev_data->program_count) != file_data->program_seen)
+            mask |= POLLIN | POLLRDNORM;
+        return mask;
+    }
+    return 0;
+}
+
+
+static void ucube_capture_vm_open(struct vm_area_struct *vma){
+    struct scope_device_data *dev_data = vma->vm_private_data;
+
+    atomic_inc(&dev_data->capture_mappings);
+}
+
+static void ucube_capture_vm_close(struct vm_area_struct *vma){
+    struct scope_device_data *dev_data = vma->vm_private_data;
+
+    atomic_dec(&dev_data->capture_mappings);
+}
+
+static const struct vm_operations_struct ucube_capture_vm_ops = {
+    .open = ucube_capture_vm_open,
+    .close = ucube_capture_vm_close,
+};
+
+static int ucube_capture_mmap(struct scope_device_data *dev_data, struct vm_area_struct *vma){
+    int rc;
+
+    if(vma->vm_flags & VM_WRITE){
+        pr_err("%s: the capture buffer can only be mapped read-only\n", __func__);
+        return -EPERM;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    /* The resize paths check capture_mappings with capture_lock held for
+     * writing before freeing the ring, so the mapping is counted under it */
+    down_read(&dev_data->capture_lock);
+    rc = remap_vmalloc_range(vma, dev_data->capture_area, vma->vm_pgoff);
+    if(rc){
+        up_read(&dev_data->capture_lock);
+        pr_err("%s: attempting to map outside of the capture buffer\n", __func__);
+        return rc;
+    }
+
+    vma->vm_ops = &ucube_capture_vm_ops;
+    vma->vm_private_data = dev_data;
+    ucube_capture_vm_open(vma);
+    up_read(&dev_data->capture_lock);
+    return 0;
+}
+
+/* The capture ring can be shared with other drivers and processes as a
+ * read-only dma-buf. While exported it counts as mapped, so it cannot be
+ * reallocated under the importers. */
+static struct sg_table *ucube_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir){
+    struct dma_buf *dmabuf = attach->dmabuf;
+    struct scope_device_data *dev_data = dmabuf->priv;
+    unsigned int n_pages = dmabuf->size >> PAGE_SHIFT;
+    struct page **pages;
+    struct sg_table *sgt;
+    int rc;
+
+    pages = kvmalloc_array(n_pages, sizeof(*pages), GFP_KERNEL);
+    if(!pages)
+        return ERR_PTR(-ENOMEM);
+    for(unsigned int i = 0; i < n_pages; i++)
+        pages[i] = vmalloc_to_page((u8 *)dev_data->capture_area + ((size_t)i << PAGE_SHIFT));
+
+    sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+    if(!sgt){
+        rc = -ENOMEM;
+        goto out_pages;
+    }
+    rc = sg_alloc_table_from_pages(sgt, pages, n_pages, 0, dmabuf->size, GFP_KERNEL);
+    if(rc)
+        goto out_sgt;
+    rc = dma_map_sgtable(attach->dev, sgt, dir, 0);
+    if(rc)
+        goto out_table;
+    kvfree(pages);
+    return sgt;
+
+out_table:
+    sg_free_table(sgt);
+out_sgt:
+    kfree(sgt);
+out_pages:
+    kvfree(pages);
+    return ERR_PTR(rc);
+}
+
+static void ucube_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir){
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+static void ucube_dmabuf_release(struct dma_buf *dmabuf){
+    struct scope_device_data *dev_data = dmabuf->priv;
 
-static struct platform_driver ucube_lkm_platform_driver = {
-        .probe = ucube_lkm_probe,
-        .remove = ucube_lkm_remove,
-        .driver = {
-                .name = "ucube_lkm",
-                .owner = THIS_MODULE,
-                .of_match_table = of_match_ptr(ucube_lkm_match_table),
-        },
-};
+    atomic_dec(&dev_data->capture_mappings);
+    kref_put(&dev_data->ref, ucube_release_instance);
+}
 
+static int ucube_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma){
+    struct scope_device_data *dev_data = dmabuf->priv;
 
-static irqreturn_t ucube_lkm_irq(int irq, void *dev_id)  {
-    if(!dev_data->is_zynqmp){
-        memcpy(dev_data->read_data_buffer_32, dev_data->dma_buffer_32, dev_data->dma_buf_size);
-    }else{
-        memcpy(dev_data->read_data_buffer_64, dev_data->dma_buffer_64, dev_data->dma_buf_size);
-    }
-    dev_data->new_data_available = 1;
-    return IRQ_RETVAL(1);
+    if(vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+    return remap_vmalloc_range(vma, dev_data->capture_area, vma->vm_pgoff);
 }
 
+static const struct dma_buf_ops ucube_dmabuf_ops = {
+    .map_dma_buf = ucube_dmabuf_map,
+    .unmap_dma_buf = ucube_dmabuf_unmap,
+    .release = ucube_dmabuf_release,
+    .mmap = ucube_dmabuf_mmap,
+};
 
-static __poll_t ucube_lkm_poll(struct file *flip , struct poll_table_struct * poll_struct){
-    int minor = MINOR(flip->f_inode->i_rdev);
-    if(minor == 0){
-        __poll_t mask = 0;
-        mask |= POLLIN | POLLRDNORM;
-        return mask;
+static int ucube_export_dmabuf(struct scope_device_data *dev_data){
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct dma_buf *dmabuf;
+    int fd;
+
+    down_read(&dev_data->capture_lock);
+    exp_info.ops = &ucube_dmabuf_ops;
+    exp_info.size = dev_data->capture_area_size;
+    exp_info.flags = O_RDONLY;
+    exp_info.priv = dev_data;
+    dmabuf = dma_buf_export(&exp_info);
+    if(IS_ERR(dmabuf)){
+        up_read(&dev_data->capture_lock);
+        return PTR_ERR(dmabuf);
     }
-    return 0;
+    atomic_inc(&dev_data->capture_mappings);
+    kref_get(&dev_data->ref);
+    up_read(&dev_data->capture_lock);
+
+    fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+    if(fd < 0)
+        dma_buf_put(dmabuf);
+    return fd;
 }
 
+/* Registers with side effects must stay strongly ordered, so only mappings
+ * that fall entirely within one of the declared ranges may be combined */
+static bool ucube_wc_allowed(struct scope_device_data *dev_data, u64 start, u64 stop){
+    for(int i = 0; i < dev_data->n_wc_ranges; i++){
+        if(start >= dev_data->wc_ranges[i].base && stop <= dev_data->wc_ranges[i].base + dev_data->wc_ranges[i].size)
+            return true;
+    }
+    return false;
+}
 
 static int ucube_lkm_mmap(struct file *filp, struct vm_area_struct *vma){
     uint64_t mapping_start_address = vma->vm_pgoff << PAGE_SHIFT;
     uint32_t mapping_size = vma->vm_end - vma->vm_start;
     uint64_t mapping_stop_address = mapping_start_address +  mapping_size;
 
-    int minor = MINOR(filp->f_inode->i_rdev);
+    int minor = ucube_minor(filp->f_inode);
+    struct ucube_file_data *file_data = filp->private_data;
+    struct scope_device_data *dev_data = file_data->dev_data;
     uint64_t mapping_limit_base_0, mapping_limit_top_0;
     uint64_t mapping_limit_base_1, mapping_limit_top_1;
 
@@ -399,9 +2475,7 @@ static int ucube_lkm_mmap(struct file *filp, struct vm_area_struct *vma){
     }
     switch (minor) {
         case 0:
-            return -1;
-            pr_err("%s: mmapping of data memory is not supported\n", __func__);
-            break;
+            return ucube_capture_mmap(dev_data, vma);
         case 1:
             if( mapping_start_address < mapping_limit_base_0 ){
                 pr_err("%s: attempting to map memory below the control bus address range (%llx)\n", __func__, mapping_start_address);
@@ -424,7 +2498,15 @@ static int ucube_lkm_mmap(struct file *filp, struct vm_area_struct *vma){
             break;
     }
 
-    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    if(file_data->map_mode == UCUBE_MAP_WRITECOMBINE){
+        if(!ucube_wc_allowed(dev_data, mapping_start_address, mapping_stop_address)){
+            pr_err("%s: range %llx-%llx is not declared safe for write combining\n", __func__, mapping_start_address, mapping_stop_address);
+            return -EINVAL;
+        }
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+    } else {
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    }
     if (remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff, mapping_size ,vma->vm_page_prot))
     return -EAGAIN;
 
@@ -434,31 +2516,228 @@ static int ucube_lkm_mmap(struct file *filp, struct vm_area_struct *vma){
 
 
 
+static void ucube_bus_limits(struct scope_device_data *dev_data, int minor, u64 *base, u64 *top){
+    if(dev_data->is_zynqmp){
+        *base = minor == 1 ? ZYNQMP_BUS_0_ADDRESS_BASE : ZYNQMP_BUS_1_ADDRESS_BASE;
+        *top = minor == 1 ? ZYNQMP_BUS_0_ADDRESS_TOP : ZYNQMP_BUS_1_ADDRESS_TOP;
+    } else {
+        *base = minor == 1 ? ZYNQ_BUS_0_ADDRESS_BASE : ZYNQ_BUS_1_ADDRESS_BASE;
+        *top = minor == 1 ? ZYNQ_BUS_0_ADDRESS_TOP : ZYNQ_BUS_1_ADDRESS_TOP;
+    }
+}
+
+/* Returns the kernel mapping of a register, reusing one of the cached bus
+ * windows or replacing the least recently used one that the current batch has
+ * not touched yet. Called with reg_lock held. */
+static void __iomem *ucube_reg_map(struct scope_device_data *dev_data, u64 address){
+    struct ucube_reg_window *window, *victim = NULL;
+    u64 base = address & ~((u64)UCUBE_REG_WINDOW_SIZE - 1);
+
+    for(int i = 0; i < UCUBE_REG_WINDOW_CACHE; i++){
+        window = &dev_data->reg_windows[i];
+        if(window->regs && window->base == base){
+            window->last_batch = dev_data->reg_batch_id;
+            return window->regs + (address - base);
+        }
+        if(window->regs && window->last_batch == dev_data->reg_batch_id)
+            continue;
+        if(!victim || !window->regs)
+            victim = window;
+        else if(victim->regs && window->last_batch < victim->last_batch)
+            victim = window;
+    }
+    if(!victim)
+        return ERR_PTR(-E2BIG);
+
+    if(victim->regs)
+        iounmap(victim->regs);
+    victim->regs = ioremap(base, UCUBE_REG_WINDOW_SIZE);
+    if(!victim->regs)
+        return ERR_PTR(-ENOMEM);
+    victim->base = base;
+    victim->last_batch = dev_data->reg_batch_id;
+    return victim->regs + (address - base);
+}
+
+static void ucube_reg_unmap_all(struct scope_device_data *dev_data){
+    for(int i = 0; i < UCUBE_REG_WINDOW_CACHE; i++){
+        if(dev_data->reg_windows[i].regs)
+            iounmap(dev_data->reg_windows[i].regs);
+        dev_data->reg_windows[i].regs = NULL;
+    }
+}
+
+static long ucube_register_batch(struct scope_device_data *dev_data, int minor, void __user *arg){
+    struct ucube_reg_batch batch;
+    struct ucube_reg_op *ops;
+    void __iomem **regs;
+    u64 bus_base, bus_top;
+    u32 value;
+    long rc = 0;
+
+    if(copy_from_user(&batch, arg, sizeof(batch)))
+        return -EFAULT;
+    if(batch.n_ops == 0 || batch.n_ops > UCUBE_REG_BATCH_MAX_OPS)
+        return -EINVAL;
+
+    ops = vmemdup_user(u64_to_user_ptr(batch.ops), batch.n_ops * sizeof(*ops));
+    if(IS_ERR(ops))
+        return PTR_ERR(ops);
+    regs = kvmalloc_array(batch.n_ops, sizeof(*regs), GFP_KERNEL);
+    if(!regs){
+        kvfree(ops);
+        return -ENOMEM;
+    }
+
+    /* Nothing is touched unless the whole batch is valid */
+    ucube_bus_limits(dev_data, minor, &bus_base, &bus_top);
+    for(u32 i = 0; i < batch.n_ops; i++){
+        if(ops[i].op > UCUBE_REG_OP_RMW || !IS_ALIGNED(ops[i].address, sizeof(u32)) ||
+           ops[i].address < bus_base || ops[i].address + sizeof(u32) - 1 > bus_top){
+            pr_err("%s: invalid register operation %u at %llx\n", __func__, ops[i].op, ops[i].address);
+            rc = -EINVAL;
+            goto out;
+        }
+    }
+
+    mutex_lock(&dev_data->reg_lock);
+    dev_data->reg_batch_id++;
+    for(u32 i = 0; i < batch.n_ops; i++){
+        regs[i] = ucube_reg_map(dev_data, ops[i].address);
+        if(IS_ERR(regs[i])){
+            rc = PTR_ERR(regs[i]);
+            mutex_unlock(&dev_data->reg_lock);
+            goto out;
+        }
+    }
+
+    for(u32 i = 0; i < batch.n_ops; i++){
+        switch(ops[i].op){
+        case UCUBE_REG_OP_READ:
+            ops[i].value = readl(regs[i]);
+            break;
+        case UCUBE_REG_OP_WRITE:
+            writel(ops[i].value, regs[i]);
+            break;
+        case UCUBE_REG_OP_RMW:
+            value = readl(regs[i]);
+            value = (value & ~ops[i].mask) | (ops[i].value & ops[i].mask);
+            writel(value, regs[i]);
+            ops[i].value = value;
+            break;
+        }
+    }
+    /* Make sure the whole batch reached the bus before returning */
+    mb();
+    mutex_unlock(&dev_data->reg_lock);
+
+    if(copy_to_user(u64_to_user_ptr(batch.ops), ops, batch.n_ops * sizeof(*ops)))
+        rc = -EFAULT;
+out:
+    kvfree(regs);
+    kvfree(ops);
+    return rc;
+}
+
 static long ucube_lkm_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-    int minor = MINOR(filp->f_inode->i_rdev);
+    int minor = ucube_minor(filp->f_inode);
+    struct ucube_file_data *file_data = filp->private_data;
+    struct scope_device_data *dev_data = file_data->dev_data;
+    struct ucube_program_request req = {0};
+    int rc;
+    if(READ_ONCE(dev_data->dead))
+        return -ENODEV;
+    if(cmd == IOCTL_REGISTER_EVENTFD)
+        return ucube_register_eventfd(file_data, (void __user *)arg);
     if(minor == 0){
-        pr_info("%s: In ioctl\n CMD: %u\n ARG: %lu\n", __func__, cmd, arg);
         switch (cmd){
         case IOCTL_NEW_DATA_AVAILABLE:
-            return dev_data->new_data_available;
+            return ucube_frame_available(file_data);
             break;
+        case IOCTL_GET_OVERRUNS:
+            return put_user(READ_ONCE(file_data->overruns), (u64 __user *)arg);
+        case IOCTL_SET_READ_MODE:
+            if(arg & ~(UCUBE_READ_META | UCUBE_READ_TRIGGERED))
+                return -EINVAL;
+            mutex_lock(&file_data->lock);
+            file_data->read_mode = arg;
+            mutex_unlock(&file_data->lock);
+            return 0;
+        case IOCTL_EXPORT_DMABUF:
+            return ucube_export_dmabuf(dev_data);
+        case IOCTL_SET_TRIGGER: {
+            struct ucube_trigger_config cfg;
+
+            if(copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+                return -EFAULT;
+            return ucube_set_trigger(dev_data, &cfg);
+        }
+        case IOCTL_SET_READ_LAYOUT: {
+            struct ucube_read_layout layout;
+
+            if(copy_from_user(&layout, (void __user *)arg, sizeof(layout)))
+                return -EFAULT;
+            if(layout.order != UCUBE_LAYOUT_INTERLEAVED && layout.order != UCUBE_LAYOUT_PLANAR)
+                return -EINVAL;
+            if(layout.channel_mask & ~UCUBE_ALL_CHANNELS)
+                return -EINVAL;
+            if(layout.decimation > UCUBE_DECIMATE_MINMAX)
+                return -EINVAL;
+            if(layout.decimation != UCUBE_DECIMATE_NONE && (!layout.factor || layout.factor > UCUBE_MAX_DECIMATION))
+                return -EINVAL;
+            if(layout.decimation == UCUBE_DECIMATE_NONE)
+                layout.factor = 1;
+            if(!layout.channel_mask)
+                layout.channel_mask = UCUBE_ALL_CHANNELS;
+            mutex_lock(&file_data->lock);
+            file_data->layout = layout;
+            mutex_unlock(&file_data->lock);
+            return 0;
+        }
         default:
             return -EINVAL;
             break;
         }
         return 0;
     }else if(minor == 3){
-        pr_info("%s: In ioctl\n CMD: %u\n ARG: %lu\n", __func__, cmd, arg);
         switch (cmd){
         case IOCTL_PROGRAM_FPGA:
-            pr_info("%s: FPGA BITSTREAM LENGTH: %lu\n", __func__, dev_data->bitstream_len);
-            ucube_program_fpga();
-            break;
+        case IOCTL_PROGRAM_FPGA_ASYNC:
+            req.handle = arg;
+            req.region = 0;
+            req.flags = cmd == IOCTL_PROGRAM_FPGA_ASYNC ? UCUBE_PROGRAM_ASYNC : 0;
+            return ucube_program_submit(dev_data, &req);
+        case IOCTL_PROGRAM_FPGA_REGION:
+            if(copy_from_user(&req, (void __user *)arg, sizeof(req)))
+                return -EFAULT;
+            if(req.flags & ~(UCUBE_PROGRAM_PARTIAL | UCUBE_PROGRAM_ASYNC))
+                return -EINVAL;
+            return ucube_program_submit(dev_data, &req);
+        case IOCTL_STORE_BITSTREAM:
+            return ucube_bitstream_store(dev_data, arg);
+        case IOCTL_DROP_BITSTREAM:
+            return ucube_bitstream_drop(dev_data, arg);
+        case IOCTL_GET_PROGRAM_RESULT:
+            return READ_ONCE(dev_data->program_result);
         default:
             return -EINVAL;
             break;
         }
         return 0;
+    }else if(minor == 1 || minor == 2){
+        switch (cmd){
+        case IOCTL_REGISTER_BATCH:
+            return ucube_register_batch(dev_data, minor, (void __user *)arg);
+        case IOCTL_SET_MAPPING_MODE:
+            if(arg != UCUBE_MAP_NONCACHED && arg != UCUBE_MAP_WRITECOMBINE)
+                return -EINVAL;
+            if(arg == UCUBE_MAP_WRITECOMBINE && !dev_data->n_wc_ranges)
+                return -EOPNOTSUPP;
+            file_data->map_mode = arg;
+            return 0;
+        default:
+            return -EINVAL;
+        }
     } else{
         return 0;
     }
@@ -467,257 +2746,721 @@ static long ucube_lkm_ioctl(struct file *filp, unsigned int cmd, unsigned long a
 
 
 static int ucube_lkm_open(struct inode *inode, struct file *file) {
+    int minor = ucube_minor(inode);
+    struct scope_device_data *dev_data;
+    struct ucube_file_data *file_data;
+
+    /* The instance outlives its removal for as long as files are open */
+    mutex_lock(&ucube_instances_lock);
+    dev_data = ucube_instances[MINOR(inode->i_rdev) / N_MINOR_NUMBERS];
+    if(dev_data)
+        kref_get(&dev_data->ref);
+    mutex_unlock(&ucube_instances_lock);
+    if(!dev_data)
+        return -ENODEV;
 
-    pr_info("%s: In open\n", __func__);
+    file_data = kzalloc(sizeof(*file_data), GFP_KERNEL);
+    if(!file_data){
+        kref_put(&dev_data->ref, ucube_release_instance);
+        return -ENOMEM;
+    }
+    file_data->dev_data = dev_data;
+    mutex_init(&file_data->lock);
+    file_data->map_mode = UCUBE_MAP_NONCACHED;
+    file_data->layout.order = UCUBE_LAYOUT_INTERLEAVED;
+    file_data->layout.channel_mask = UCUBE_ALL_CHANNELS;
+    file_data->layout.decimation = UCUBE_DECIMATE_NONE;
+    file_data->layout.factor = 1;
+    file_data->program_seen = READ_ONCE(dev_data->program_count);
+    file->private_data = file_data;
+
+    /* The data and bitstream state reads honour IOCB_NOWAIT, which io_uring
+     * only tries on blocking files that advertise it */
+    if(minor == 0 || minor == 3)
+        file->f_mode |= FMODE_NOWAIT;
+
+    /* Opening the bitstream for writing with O_TRUNC discards a partial upload */
+    if(minor == 3 && (file->f_mode & FMODE_WRITE) && (file->f_flags & O_TRUNC)){
+        mutex_lock(&dev_data->bitstream_lock);
+        ucube_bitstream_free(&dev_data->bitstream);
+        mutex_unlock(&dev_data->bitstream_lock);
+    }
 
+    /* Every reader has its own cursor into the ring and starts from the most
+     * recent frame rather than from a backlog it was not there for */
+    INIT_LIST_HEAD(&file_data->reader_node);
+    INIT_LIST_HEAD(&file_data->event_node);
+    if(minor == 0 && (file->f_mode & FMODE_READ)){
+        down_write(&dev_data->capture_lock);
+        file_data->read_tail = smp_load_acquire(&dev_data->capture_head);
+        list_add(&file_data->reader_node, &dev_data->capture_readers);
+        up_write(&dev_data->capture_lock);
+    }
     return 0;
 }
 
 static int ucube_lkm_release(struct inode *inode, struct file *file) {
-    pr_info("%s: In release\n", __func__);
+    int minor = ucube_minor(inode);
+
+    struct ucube_file_data *file_data = file->private_data;
+    struct scope_device_data *dev_data = file_data->dev_data;
+    unsigned long flags;
+    int i;
+
+    if(minor == 0 && (file->f_mode & FMODE_READ)){
+        down_write(&dev_data->capture_lock);
+        list_del(&file_data->reader_node);
+        up_write(&dev_data->capture_lock);
+    }
+
+    spin_lock_irqsave(&dev_data->event_lock, flags);
+    list_del(&file_data->event_node);
+    spin_unlock_irqrestore(&dev_data->event_lock, flags);
+    for(i = 0; i < UCUBE_N_EVENTS; i++)
+        if(file_data->events[i])
+            eventfd_ctx_put(file_data->events[i]);
+    kfree(file_data);
+    kref_put(&dev_data->ref, ucube_release_instance);
     return 0;
 }
 
-static ssize_t ucube_lkm_read(struct file *flip, char *buffer, size_t count, loff_t *offset) {
-    size_t datalen;
-    unsigned long ret;
-    char result;
-    int minor = MINOR(flip->f_inode->i_rdev);
-    if(minor == 0){
-        datalen = dev_data->dma_buf_size;
+/* Reduces the run of layout->factor samples starting at src to the values
+ * delivered for channel and returns how many were stored in out */
+static unsigned int ucube_reduce(const u8 *src, u32 width, u32 channel, const struct ucube_read_layout *layout, s64 *out){
+    s64 value, lo, hi, sum;
+    s32 rem, carry;
+    u32 i;
+
+    switch(layout->decimation){
+    case UCUBE_DECIMATE_AVERAGE:
+        sum = 0;
+        if(width < sizeof(u64)){
+            /* up to UCUBE_MAX_DECIMATION samples of at most 32 bits */
+            for(i = 0; i < layout->factor; i++)
+                sum += ucube_load_sample(src + (i * N_SCOPE_CHANNELS + channel) * width, width);
+            out[0] = div_s64(sum, layout->factor);
+            return 1;
+        }
+        /* Raw ZynqMP words use all 64 bits with the channel tag on top, so
+         * their sum can overflow: the quotients by factor are summed
+         * instead and the remainders carried separately */
+        carry = 0;
+        for(i = 0; i < layout->factor; i++){
+            value = ucube_load_sample(src + (i * N_SCOPE_CHANNELS + channel) * width, width);
+            sum += div_s64_rem(value, layout->factor, &rem);
+            carry += rem;
+            if(carry >= (s32)layout->factor){
+                sum++;
+                carry -= layout->factor;
+            } else if(carry <= -(s32)layout->factor){
+                sum--;
+                carry += layout->factor;
+            }
+        }
+        /* truncate towards zero like div_s64 on the exact sum */
+        if(sum > 0 && carry < 0)
+            sum--;
+        else if(sum < 0 && carry > 0)
+            sum++;
+        out[0] = sum;
+        return 1;
+    case UCUBE_DECIMATE_MINMAX:
+        lo = hi = ucube_load_sample(src + channel * width, width);
+        for(i = 1; i < layout->factor; i++){
+            value = ucube_load_sample(src + (i * N_SCOPE_CHANNELS + channel) * width, width);
+            lo = min(lo, value);
+            hi = max(hi, value);
+        }
+        out[0] = lo;
+        out[1] = hi;
+        return 2;
+    default:
+        out[0] = ucube_load_sample(src + channel * width, width);
+        return 1;
+    }
+}
 
+/* Copies count samples of a constant width from src to dst, stepping each
+ * side by its own stride */
+static __always_inline unsigned int ucube_gather(u8 *dst, size_t dst_stride, const u8 *src, size_t src_stride, unsigned int count, u32 width){
+    for(unsigned int i = 0; i < count; i++)
+        memcpy(dst + i * dst_stride, src + i * src_stride, width);
+    return count * width;
+}
 
-        if (count > datalen) {
-            count = datalen;
-        }
+/* Hoists the width out of the gather loop so each sample is a single load and
+ * store rather than a trip through ucube_load_sample and ucube_store_sample */
+static unsigned int ucube_gather_width(u8 *dst, size_t dst_stride, const u8 *src, size_t src_stride, unsigned int count, u32 width){
+    switch(width){
+    case 2:
+        return ucube_gather(dst, dst_stride, src, src_stride, count, 2);
+    case 3:
+        return ucube_gather(dst, dst_stride, src, src_stride, count, 3);
+    case 4:
+        return ucube_gather(dst, dst_stride, src, src_stride, count, 4);
+    default:
+        return ucube_gather(dst, dst_stride, src, src_stride, count, 8);
+    }
+}
 
-        if(!dev_data->is_zynqmp){
-            ret = copy_to_user(buffer, dev_data->read_data_buffer_32, count);
-        }else{
-            ret = copy_to_user(buffer, dev_data->read_data_buffer_64, count);
+/* Without decimation the selected samples are delivered unchanged, so they
+ * are gathered a column at a time: a whole chunk of one channel for planar
+ * output, or each selected channel into its place in a block of runs for
+ * interleaved output */
+static int ucube_copy_selected(const u8 *src, u32 width, u32 n_runs, const struct ucube_read_layout *layout, struct iov_iter *to){
+    u8 chunk[UCUBE_LAYOUT_CHUNK];
+    size_t frame = N_SCOPE_CHANNELS * width;
+    size_t out_run = hweight32(layout->channel_mask) * width;
+    unsigned int fill, count, column;
+    u32 channel, run;
+
+    if(layout->order == UCUBE_LAYOUT_PLANAR){
+        for(channel = 0; channel < N_SCOPE_CHANNELS; channel++){
+            if(!(layout->channel_mask & BIT(channel)))
+                continue;
+            for(run = 0; run < n_runs; run += count){
+                count = min_t(u32, n_runs - run, UCUBE_LAYOUT_CHUNK / width);
+                fill = ucube_gather_width(chunk, width, src + run * frame + channel * width, frame, count, width);
+                if(copy_to_iter(chunk, fill, to) != fill)
+                    return -EFAULT;
+            }
         }
+        return 0;
+    }
 
-        if(ret) {
-            return -EFAULT;
+    for(run = 0; run < n_runs; run += count){
+        count = min_t(u32, n_runs - run, UCUBE_LAYOUT_CHUNK / out_run);
+        column = 0;
+        for(channel = 0; channel < N_SCOPE_CHANNELS; channel++){
+            if(!(layout->channel_mask & BIT(channel)))
+                continue;
+            ucube_gather_width(chunk + column, out_run, src + run * frame + channel * width, frame, count, width);
+            column += width;
         }
-        dev_data->new_data_available = 0;
-        return count;    
-    } else if(minor == 3){
-        result = ucube_fpga_loaded() ?'1' : '0';
-        if (copy_to_user(buffer, &result, 1)) return -EFAULT;
-        return 1;
+        fill = count * out_run;
+        if(copy_to_iter(chunk, fill, to) != fill)
+            return -EFAULT;
     }
+    return 0;
+}
 
+/* Gathers the selected channels of n_runs runs of samples into the user
+ * buffer, going through a small bounce buffer on the stack so the reordering
+ * and decimation happen during the copy to userspace rather than in a
+ * separate pass. */
+static int ucube_copy_layout(const u8 *src, u32 width, u32 n_runs, const struct ucube_read_layout *layout, struct iov_iter *to){
+    u8 chunk[UCUBE_LAYOUT_CHUNK];
+    s64 values[2];
+    unsigned int fill = 0, n;
+    bool planar = layout->order == UCUBE_LAYOUT_PLANAR;
+    size_t run_stride = (size_t)layout->factor * N_SCOPE_CHANNELS * width;
+    u32 outer, inner, n_outer, n_inner, channel, run;
+
+    if(layout->decimation == UCUBE_DECIMATE_NONE)
+        return ucube_copy_selected(src, width, n_runs, layout, to);
+
+    n_outer = planar ? N_SCOPE_CHANNELS : n_runs;
+    n_inner = planar ? n_runs : N_SCOPE_CHANNELS;
+
+    for(outer = 0; outer < n_outer; outer++){
+        if(planar && !(layout->channel_mask & BIT(outer)))
+            continue;
+        for(inner = 0; inner < n_inner; inner++){
+            channel = planar ? outer : inner;
+            run = planar ? inner : outer;
+            if(!(layout->channel_mask & BIT(channel)))
+                continue;
+            n = ucube_reduce(src + run * run_stride, width, channel, layout, values);
+            for(unsigned int i = 0; i < n; i++, fill += width)
+                ucube_store_sample(chunk + fill, values[i], width);
+            if(fill > UCUBE_LAYOUT_CHUNK - 2 * sizeof(u64)){
+                if(copy_to_iter(chunk, fill, to) != fill)
+                    return -EFAULT;
+                fill = 0;
+            }
+        }
+    }
+    if(fill && copy_to_iter(chunk, fill, to) != fill)
+        return -EFAULT;
     return 0;
 }
 
+/* Copies a frame out of its slot without excluding the interrupt thread: the
+ * slot lock is sampled around the copy as described for the capture header,
+ * and -EAGAIN is returned if the frame was overwritten in the meantime. The
+ * frame metadata is filled in and meta->length set to the bytes copied.
+ * Called with capture_lock held for reading, which only keeps the capture
+ * area from being resized. */
+static ssize_t ucube_copy_frame(struct scope_device_data *dev_data, u64 frame, struct iov_iter *to, const struct ucube_read_layout *layout, bool with_meta, struct ucube_frame_meta *meta){
+    struct ucube_slot_header *slot_header;
+    size_t meta_len = with_meta ? sizeof(*meta) : 0;
+    size_t count = iov_iter_count(to) - meta_len;
+    u32 slot, seq, n_runs, n_values, width;
+    bool plain;
+    int rc = 0;
+
+    div_u64_rem(frame, dev_data->capture_slots, &slot);
+    slot_header = &dev_data->capture_header->slots[slot];
+
+    seq = READ_ONCE(slot_header->lock);
+    smp_rmb();
+    if((seq & 1) || READ_ONCE(slot_header->sequence) != frame)
+        return -EAGAIN;
+
+    meta->sequence = frame;
+    meta->timestamp = READ_ONCE(slot_header->timestamp);
+    meta->dropped = READ_ONCE(slot_header->dropped);
+    meta->format = READ_ONCE(slot_header->format);
+    meta->sample_width = width = READ_ONCE(slot_header->sample_width);
+
+    plain = layout->order == UCUBE_LAYOUT_INTERLEAVED && layout->channel_mask == UCUBE_ALL_CHANNELS &&
+            layout->decimation == UCUBE_DECIMATE_NONE;
+    if(plain){
+        meta->length = min_t(size_t, count, READ_ONCE(slot_header->length));
+    } else {
+        /* values delivered per run of samples, over all selected channels */
+        n_values = hweight32(layout->channel_mask);
+        if(layout->decimation == UCUBE_DECIMATE_MINMAX)
+            n_values *= 2;
+        n_runs = READ_ONCE(slot_header->length) / (N_SCOPE_CHANNELS * width * layout->factor);
+        n_runs = min_t(size_t, n_runs, count / (n_values * width));
+        meta->length = n_runs * n_values * width;
+    }
 
-static ssize_t ucube_lkm_write(struct file *flip, const char *buffer, size_t len, loff_t *offset) {
-    size_t needed;
-    int minor = MINOR(flip->f_inode->i_rdev);
-    if(minor == 3){
-        needed = *offset + len;
+    if(with_meta){
+        meta->read_timestamp = ktime_get_ns();
+        if(copy_to_iter(meta, sizeof(*meta), to) != sizeof(*meta))
+            return -EFAULT;
+    }
+    if(plain){
+        if(copy_to_iter(ucube_slot_data(dev_data, slot), meta->length, to) != meta->length)
+            rc = -EFAULT;
+    } else {
+        rc = ucube_copy_layout(ucube_slot_data(dev_data, slot), width, n_runs, layout, to);
+    }
+    if(rc)
+        return rc;
 
-        if (needed > BITSTREAM_BUFFER_SIZE)
-            return -EINVAL;
+    smp_rmb();
+    if(READ_ONCE(slot_header->lock) != seq){
+        iov_iter_revert(to, meta_len + meta->length);
+        return -EAGAIN;
+    }
+    return meta_len + meta->length;
+}
 
-        if (copy_from_user(dev_data->bitstream_buffer + *offset, buffer, len))
-            return -EFAULT;
+/* Delivers the next frame of the file into to, read() and splice() both end
+ * up here. A nowait read does not even wait for another reader of the file
+ * to finish. */
+static ssize_t ucube_read_frame(struct file *flip, struct iov_iter *to, bool nonblock, bool nowait){
+    struct ucube_file_data *file_data = flip->private_data;
+    struct scope_device_data *dev_data = file_data->dev_data;
+    struct ucube_frame_meta meta = {0};
+    bool with_meta;
+    u64 head, frame, latency;
+    unsigned long flags;
+    ssize_t rc;
+
+    /* The cursor, layout and mode belong to the file, so readers of
+     * different files only share capture_lock, which the resize paths take
+     * for writing */
+    if(nowait){
+        if(!mutex_trylock(&file_data->lock))
+            return -EAGAIN;
+        if(!down_read_trylock(&dev_data->capture_lock)){
+            mutex_unlock(&file_data->lock);
+            return -EAGAIN;
+        }
+    } else {
+        if(mutex_lock_interruptible(&file_data->lock))
+            return -ERESTARTSYS;
+        down_read(&dev_data->capture_lock);
+    }
+    with_meta = file_data->read_mode & UCUBE_READ_META;
+    if(with_meta && iov_iter_count(to) < sizeof(meta)){
+        rc = -EINVAL;
+        goto out_unlock;
+    }
+    for(;;){
+        head = smp_load_acquire(&dev_data->capture_head);
+        frame = ucube_next_frame(file_data);
+        if(frame >= head){
+            up_read(&dev_data->capture_lock);
+            mutex_unlock(&file_data->lock);
+            if(nonblock)
+                return -EAGAIN;
+            if(wait_event_interruptible(*ucube_reader_wq(file_data), ucube_frame_available(file_data) || READ_ONCE(dev_data->dead)))
+                return -ERESTARTSYS;
+            if(READ_ONCE(dev_data->dead))
+                return -ENODEV;
+            if(mutex_lock_interruptible(&file_data->lock))
+                return -ERESTARTSYS;
+            down_read(&dev_data->capture_lock);
+            continue;
+        }
+        /* frames outside the trigger windows are not delivered */
+        file_data->read_tail = frame;
+
+        /* Skip the frames that were overwritten before we got to them */
+        if(head - file_data->read_tail > dev_data->capture_slots){
+            meta.skipped += head - dev_data->capture_slots - file_data->read_tail;
+            file_data->read_tail = head - dev_data->capture_slots;
+            if(file_data->read_mode & UCUBE_READ_TRIGGERED)
+                continue;
+        }
 
-        *offset += len;
-        if (dev_data->bitstream_len < *offset)
-            dev_data->bitstream_len = *offset;
-        return len;
+        frame = file_data->read_tail;
+        WRITE_ONCE(file_data->read_tail, frame + 1);
+        rc = ucube_copy_frame(dev_data, frame, to, &file_data->layout, with_meta, &meta);
+        if(rc != -EAGAIN)
+            break;
+
+        /* The interrupt thread lapped us during the copy, the frame is gone */
+        spin_lock_irqsave(&dev_data->read_stats_lock, flags);
+        dev_data->torn_reads++;
+        spin_unlock_irqrestore(&dev_data->read_stats_lock, flags);
+        meta.skipped++;
     }
-    
-    pr_info("%s: In write with minor number %d\n", __func__, minor);
-    return len;
+    file_data->overruns += meta.skipped;
+    spin_lock_irqsave(&dev_data->read_stats_lock, flags);
+    dev_data->capture_header->overruns += meta.skipped;
+    spin_unlock_irqrestore(&dev_data->read_stats_lock, flags);
+out_unlock:
+    up_read(&dev_data->capture_lock);
+    mutex_unlock(&file_data->lock);
+    ucube_signal_event(dev_data, UCUBE_EVENT_OVERRUN, meta.skipped);
+    if(rc < 0)
+        return rc;
+
+    /* Readers of different files get here concurrently */
+    latency = ktime_get_ns() - meta.timestamp;
+    spin_lock_irqsave(&dev_data->read_stats_lock, flags);
+    ucube_hist_add(dev_data->read_latency_hist, latency);
+    spin_unlock_irqrestore(&dev_data->read_stats_lock, flags);
+    trace_ucube_read(frame, meta.length, latency, meta.skipped);
+    return rc;
 }
 
+/* Moves frames into a pipe without a round trip through userspace, this is
+ * what sendfile() and splice() from the data device use. Each call delivers
+ * at most one frame, and as with a short read() the part of the frame that
+ * does not fit in len is dropped rather than kept for the next call. */
+static ssize_t ucube_lkm_splice_read(struct file *flip, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags){
+    struct iov_iter to;
+    ssize_t rc;
 
-static void free_device_data(struct device *d)
-{
-    
-	struct scope_device_data *dev_data;
+    if(ucube_minor(flip->f_inode) != 0)
+        return -EINVAL;
 
-    pr_info("%s: In free_device_data\n", __func__);
+    iov_iter_pipe(&to, READ, pipe, len);
+    rc = ucube_read_frame(flip, &to, (flags & SPLICE_F_NONBLOCK) || (flip->f_flags & O_NONBLOCK), false);
+    /* A failed copy may already have filled pipe buffers, release them so
+     * no partial frame is left in the pipe */
+    if(rc < 0)
+        iov_iter_revert(&to, len - iov_iter_count(&to));
+    return rc;
+}
 
-    for(int i = 0; i< N_MINOR_NUMBERS; i++){
-       dev_data = container_of(d, struct scope_device_data, devs[i]);
+/* Reads go through iov_iter so that vectored reads, for example one iovec per
+ * channel of a planar layout, and IOCB_NOWAIT submissions from io_uring are
+ * served without a bounce through a worker thread */
+static ssize_t ucube_lkm_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct file *flip = iocb->ki_filp;
+    struct scope_device_data *dev_data = ucube_file_dev(flip);
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    char result;
+    int state;
+    int minor = ucube_minor(flip->f_inode);
+    if(READ_ONCE(dev_data->dead))
+        return -ENODEV;
+    if(minor == 0){
+        return ucube_read_frame(flip, to, nowait || (flip->f_flags & O_NONBLOCK), nowait);
+    } else if(minor == 3){
+        struct ucube_file_data *file_data = flip->private_data;
+
+        spin_lock(&dev_data->program_state_lock);
+        state = dev_data->program_state;
+        file_data->program_seen = dev_data->program_count;
+        spin_unlock(&dev_data->program_state_lock);
+
+        if(state == UCUBE_FPGA_PROGRAMMING)
+            result = 'P';
+        else if(state == UCUBE_FPGA_FAILED)
+            result = 'E';
+        else
+            result = ucube_fpga_loaded(dev_data) ?'1' : '0';
+        if (copy_to_iter(&result, 1, to) != 1) return -EFAULT;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Bitstream uploads allocate pages as they go, so IOCB_NOWAIT writes are
+ * always handed back to be retried from a context that may block */
+static ssize_t ucube_lkm_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct file *flip = iocb->ki_filp;
+    struct scope_device_data *dev_data = ucube_file_dev(flip);
+    loff_t *offset = &iocb->ki_pos;
+    size_t len = iov_iter_count(from);
+    size_t needed, chunk;
+    int rc;
+    struct ucube_bitstream *image = &dev_data->bitstream;
+    int minor = ucube_minor(flip->f_inode);
+    if(READ_ONCE(dev_data->dead))
+        return -ENODEV;
+    if(minor == 3){
+        if (iocb->ki_flags & IOCB_NOWAIT)
+            return -EAGAIN;
+        if (*offset < 0 || *offset > BITSTREAM_MAX_SIZE || len > BITSTREAM_MAX_SIZE - *offset)
+            return -EINVAL;
+        needed = *offset + len;
+
+        mutex_lock(&dev_data->bitstream_lock);
+        /* The format is only known once the first four bytes are in, a
+         * shorter first write is held back until the rest arrives */
+        chunk = 0;
+        rc = 0;
+        if(!image->len && !image->decomp && *offset == image->head_len){
+            chunk = min_t(size_t, len, sizeof(image->head) - image->head_len);
+            if(copy_from_iter(image->head + image->head_len, chunk, from) != chunk){
+                rc = -EFAULT;
+                goto out_unlock;
+            }
+            image->head_len += chunk;
+            if(image->head_len < sizeof(image->head))
+                goto out_done;
+            rc = ucube_bitstream_flush_head(image);
+        } else if(image->head_len){
+            rc = ucube_bitstream_flush_head(image);
+        }
+        if (rc)
+            goto out_unlock;
+
+        if(image->decomp){
+            rc = ucube_decomp_write(image, *offset + chunk, from, len - chunk);
+        } else {
+            rc = ucube_bitstream_reserve(image, needed);
+            if (!rc)
+                rc = ucube_bitstream_copy_from_iter(image, *offset + chunk, from, len - chunk);
+            if (!rc && image->len < needed)
+                image->len = needed;
+        }
+        if (rc)
+            goto out_unlock;
+
+out_done:
+        *offset += len;
+        rc = len;
+out_unlock:
+        mutex_unlock(&dev_data->bitstream_lock);
+        return rc;
     }
 
-	kfree(dev_data);
+    return len;
 }
 
 
 /* This structure points to all of the device functions */
 static struct file_operations file_ops = {
-    .read = ucube_lkm_read,
-    .write = ucube_lkm_write,
+    .read_iter = ucube_lkm_read_iter,
+    .write_iter = ucube_lkm_write_iter,
     .open = ucube_lkm_open,
     .unlocked_ioctl = ucube_lkm_ioctl,
     .poll = ucube_lkm_poll,
     .release = ucube_lkm_release,
-    .mmap = ucube_lkm_mmap
+    .mmap = ucube_lkm_mmap,
+    .splice_read = ucube_lkm_splice_read
 };
 
 
 
+/* Device names and the debugfs directory of instance 0 keep their historical
+ * names, later instances get their number appended */
+static const char *ucube_instance_name(struct scope_device_data *dev_data, const char *base){
+    if(!dev_data->id)
+        return kstrdup(base, GFP_KERNEL);
+    return kasprintf(GFP_KERNEL, "%s-%d", base, dev_data->id);
+}
+
+/* Frees an instance once it has been removed and the last file, mapping and
+ * exported dma-buf referring to it are gone */
+static void ucube_release_instance(struct kref *ref){
+    struct scope_device_data *dev_data = container_of(ref, struct scope_device_data, ref);
+
+    pr_info("%s: releasing instance %d\n", __func__, dev_data->id);
+    ucube_free_dma_buffer(dev_data);
+    ucube_free_capture_area(dev_data);
+    ucube_reg_unmap_all(dev_data);
+    for(unsigned int i = 0; i < dev_data->n_fpga_regions; i++)
+        of_node_put(dev_data->fpga_nodes[i]);
+
+    ucube_bitstream_free(&dev_data->bitstream);
+    ucube_bitstream_free(&dev_data->program_image);
+    while(!list_empty(&dev_data->bitstream_cache))
+        ucube_cache_remove(dev_data, list_first_entry(&dev_data->bitstream_cache, struct ucube_cached_bitstream, node));
+
+    ida_free(&ucube_ida, dev_data->id);
+    put_device(dev_data->dev);
+    kfree(dev_data);
+}
+
+
 static int __init ucube_lkm_init(void) {
-    int dev_rc, platform_rc, irq_rc;
-    int major;
-    int cdev_rcs[N_MINOR_NUMBERS];
-    dev_t devices[N_MINOR_NUMBERS];
-    const char* const device_names[] = { "uscope_data", "uscope_BUS_0", "uscope_BUS_1", "uscope_bitstream"}; 
-    
+    int dev_rc, platform_rc;
+
     /* DYNAMICALLY ALLOCATE DEVICE NUMBERS, CLASSES, ETC.*/
     pr_info("%s: In init\n", __func__);
 
-    dev_rc = alloc_chrdev_region(&device_number, 0, N_MINOR_NUMBERS,"uCube DMA");
-    
+    dev_rc = alloc_chrdev_region(&device_number, 0, N_MINOR_NUMBERS * UCUBE_MAX_INSTANCES, "uCube DMA");
+
     if (dev_rc) {
         pr_err("%s: Failed to obtain major/minors\nError:%d\n", __func__, dev_rc);
         return dev_rc;
     }
 
-    major = MAJOR(device_number);
     uCube_class = class_create(THIS_MODULE, "uCube_scope");
-    
-
-    for(int i = 0; i< N_MINOR_NUMBERS; i++){
-        devices[i] = MKDEV(major, i);
+    if(IS_ERR(uCube_class)){
+        unregister_chrdev_region(device_number, N_MINOR_NUMBERS * UCUBE_MAX_INSTANCES);
+        return PTR_ERR(uCube_class);
     }
 
-    dev_data = kzalloc(sizeof(*dev_data), GFP_KERNEL);
-    dev_data->new_data_available = 0;
-
-    for(int i = 0; i< N_MINOR_NUMBERS; i++){
-        dev_data->devs[i].devt =  devices[i];
-        dev_data->devs[i].class = uCube_class;
-        dev_data->devs[i].release = free_device_data;
-        dev_set_name(&dev_data->devs[i], device_names[i]);
-        device_initialize(&dev_data->devs[i]);
-        cdev_init(&dev_data->cdevs[i], &file_ops);
-        cdev_rcs[i] = cdev_add(&dev_data->cdevs[i], devices[i], 1);
-        if (cdev_rcs[i]) {
-        pr_info("%s: Failed in adding cdev[%d] to subsystem "
-                "retval:%d\n", __func__, i, cdev_rcs[i]);
-        }
-        else {
-            device_create(uCube_class, NULL, devices[i], NULL, device_names[i]);
-        }
-        pr_info("%s: finished setup for endpoint: %s\n", __func__, device_names[i]);
-    }
-    
-    /* SETUP PLATFORM DRIVER */
+    /* SETUP PLATFORM DRIVER, THE INSTANCES ARE CREATED AS THE DT NODES ARE PROBED */
     platform_rc = platform_driver_register(&ucube_lkm_platform_driver);
     if (platform_rc) {
         pr_err("%s: Failed to initialize platform driver\nError:%d\n", __func__, platform_rc);
+        class_destroy(uCube_class);
+        unregister_chrdev_region(device_number, N_MINOR_NUMBERS * UCUBE_MAX_INSTANCES);
         return platform_rc;
     }
+    return 0;
+}
 
-    dev_data->dma_buf_size = KERNEL_BUFFER_LENGTH;
-    /*SETUP AND ALLOCATE DMA BUFFER*/
-    if(!dev_data->is_zynqmp){
-        dma_set_coherent_mask(&dev_data->devs[0], DMA_BIT_MASK(32));
-        dev_data->dma_buffer_32 = dma_alloc_coherent(
-            &dev_data->devs[0],
-            dev_data->dma_buf_size,
-            &(dev_data->physaddr),
-            GFP_KERNEL ||GFP_ATOMIC
-        );
-       pr_warn("%s: Allocated 32 bit dma buffer at: %llu\n", __func__, dev_data->physaddr);
-    }else{
-        dma_set_coherent_mask(&dev_data->devs[0], DMA_BIT_MASK(64));
-        dev_data->dma_buffer_64 = dma_alloc_coherent(
-            &dev_data->devs[0],
-            dev_data->dma_buf_size,
-            &(dev_data->physaddr),
-            GFP_KERNEL ||GFP_ATOMIC
-        );
-        pr_warn("%s: Allocated 64 bit dma buffer at: %llu\n", __func__, dev_data->physaddr);
-    }
-    
-    
-    /*SETUP AND ALLOCATE DATA BUFFER*/
-
-    if(!dev_data->is_zynqmp){
-        dev_data->read_data_buffer_32 = vmalloc(dev_data->dma_buf_size);
-    } else{
-        dev_data->read_data_buffer_64 = vmalloc(dev_data->dma_buf_size);
-    }
+static void __exit ucube_lkm_exit(void) {
+    pr_info("%s: In exit\n", __func__);
 
-    /* SETUP INTERRUPT HANDLER*/      
-    pr_warn("%s: setup interrupts\n", __func__);
-    irq_rc = request_irq(irq_line, ucube_lkm_irq, 0, "ucube_lkm", NULL);
-    //pr_warn("%s: unassigned irqs: %lu\n", __func__, probe_irq_on());
+    platform_driver_unregister(&ucube_lkm_platform_driver);
 
-    // Allocate bistream buffer
-    dev_data->bitstream_buffer = vmalloc(BITSTREAM_BUFFER_SIZE);
-    
-    return irq_rc;
+	class_destroy(uCube_class);
+	unregister_chrdev_region(device_number, N_MINOR_NUMBERS * UCUBE_MAX_INSTANCES);
+    ida_destroy(&ucube_ida);
 }
 
-static void __exit ucube_lkm_exit(void) {
+static int ucube_create_minors(struct scope_device_data *dev_data){
+    const char* const device_names[] = { "uscope_data", "uscope_BUS_0", "uscope_BUS_1", "uscope_bitstream"};
+    const char *name;
+    struct device *node;
+    int i, rc;
 
-	int major = MAJOR(device_number);
-    
-    pr_info("%s: In exit\n", __func__);
-    free_irq(irq_line, NULL);
+    for(i = 0; i< N_MINOR_NUMBERS; i++){
+        dev_t devt = dev_data->devt + i;
 
-    if(!dev_data->is_zynqmp){
-        dma_free_coherent(
-            &dev_data->devs[0],
-            dev_data->dma_buf_size,
-            dev_data->dma_buffer_32,
-            dev_data->physaddr
-        );
-        vfree(dev_data->read_data_buffer_32);
-    } else{
-        dma_free_coherent(
-            &dev_data->devs[0],
-            dev_data->dma_buf_size,
-            dev_data->dma_buffer_64,
-            dev_data->physaddr
-        );
-        vfree(dev_data->read_data_buffer_64);
+        cdev_init(&dev_data->cdevs[i], &file_ops);
+        dev_data->cdevs[i].owner = THIS_MODULE;
+        rc = cdev_add(&dev_data->cdevs[i], devt, 1);
+        if (rc) {
+            pr_err("%s: Failed in adding cdev[%d] to subsystem "
+                    "retval:%d\n", __func__, i, rc);
+            goto out_unwind;
+        }
+        name = ucube_instance_name(dev_data, device_names[i]);
+        node = name ? device_create(uCube_class, dev_data->dev, devt, NULL, "%s", name) : ERR_PTR(-ENOMEM);
+        kfree(name);
+        if(IS_ERR(node)){
+            rc = PTR_ERR(node);
+            cdev_del(&dev_data->cdevs[i]);
+            goto out_unwind;
+        }
+        pr_info("%s: finished setup for endpoint: %s\n", __func__, dev_name(node));
     }
+    return 0;
 
-    vfree(dev_data->bitstream_buffer);
-    
-    
-    platform_driver_unregister(&ucube_lkm_platform_driver);	
-    
+out_unwind:
+    while(i--){
+        device_destroy(uCube_class, dev_data->devt + i);
+        cdev_del(&dev_data->cdevs[i]);
+    }
+    return rc;
+}
 
+static void ucube_destroy_minors(struct scope_device_data *dev_data){
     for(int i = 0; i< N_MINOR_NUMBERS; i++){
-        int device = MKDEV(major, i);
-
+        device_destroy(uCube_class, dev_data->devt + i);
         cdev_del(&dev_data->cdevs[i]);
-        device_destroy(uCube_class, device);
     }
-
-
-	class_destroy(uCube_class);
-	unregister_chrdev_region(device_number, N_MINOR_NUMBERS);
-    
 }
 
 int ucube_lkm_probe(struct platform_device *pdev){
-    int rc;
-	char const * driver_mode;
+    struct scope_device_data *dev_data;
+    int rc, n_wc, id;
+	char const * driver_mode = "";
+    const char *name;
+    struct device_node *np;
 
     pr_info("%s: In platform probe\n", __func__);
-    
-    irq_line = platform_get_irq(pdev, 0);
+
+    id = ida_alloc_max(&ucube_ida, UCUBE_MAX_INSTANCES - 1, GFP_KERNEL);
+    if(id < 0){
+        pr_err("%s: No free instance for %pOF\n", __func__, pdev->dev.of_node);
+        return id;
+    }
+
+    dev_data = kzalloc(sizeof(*dev_data), GFP_KERNEL);
+    if(!dev_data){
+        ida_free(&ucube_ida, id);
+        return -ENOMEM;
+    }
+    kref_init(&dev_data->ref);
+    dev_data->id = id;
+    dev_data->dev = get_device(&pdev->dev);
+    dev_data->devt = MKDEV(MAJOR(device_number), id * N_MINOR_NUMBERS);
+    init_rwsem(&dev_data->capture_lock);
+    spin_lock_init(&dev_data->read_stats_lock);
+    init_waitqueue_head(&dev_data->capture_wq);
+    INIT_LIST_HEAD(&dev_data->capture_readers);
+    INIT_LIST_HEAD(&dev_data->event_files);
+    spin_lock_init(&dev_data->event_lock);
+    spin_lock_init(&dev_data->trigger_lock);
+    init_waitqueue_head(&dev_data->trigger_wq);
+    dev_data->coalesce_rate = coalesce_rate;
+    dev_data->coalesce_batch = UCUBE_COALESCE_DEFAULT_BATCH;
+    dev_data->coalesce_timeout_us = UCUBE_COALESCE_DEFAULT_TIMEOUT_US;
+    dev_data->coalesce_since = ktime_get_ns();
+    hrtimer_init(&dev_data->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev_data->coalesce_timer.function = ucube_coalesce_flush;
+    mutex_init(&dev_data->reg_lock);
+    mutex_init(&dev_data->bitstream_lock);
+    INIT_LIST_HEAD(&dev_data->bitstream_cache);
+    dev_data->bitstream_cache_limit = bitstream_cache_size;
+    INIT_WORK(&dev_data->program_work, ucube_program_work);
+    spin_lock_init(&dev_data->program_state_lock);
+    init_waitqueue_head(&dev_data->program_wq);
+    dev_data->capture_slots = clamp_val(capture_slots, 1, UCUBE_MAX_CAPTURE_SLOTS);
+    dev_data->irq_cpu = -1;
+    platform_set_drvdata(pdev, dev_data);
+
+    dev_data->irq = platform_get_irq(pdev, 0);
+    if(dev_data->irq < 0){
+        rc = dev_data->irq;
+        goto out_put;
+    }
 
     of_property_read_string(pdev->dev.of_node, "ucubever", &driver_mode);
 
     pr_info("%s: driver target is %s\n", __func__, driver_mode);
     dev_data->is_zynqmp = strncmp(driver_mode, "zynqmp", 6)==0;
 
-
-
-    rc = sysfs_create_group(&pdev->dev.kobj, &uscope_lkm_attr_group);
+    /* OPTIONAL <base size> PAIRS OF BUS RANGES SAFE FOR WRITE COMBINING */
+    n_wc = of_property_count_u64_elems(pdev->dev.of_node, "wc-ranges");
+    if(n_wc > 0){
+        n_wc = min(n_wc / 2, UCUBE_MAX_WC_RANGES);
+        of_property_read_u64_array(pdev->dev.of_node, "wc-ranges", (u64 *)dev_data->wc_ranges, n_wc * 2);
+        dev_data->n_wc_ranges = n_wc;
+        for(int i = 0; i < n_wc; i++)
+            pr_info("%s: write combining allowed on %llx-%llx\n", __func__, dev_data->wc_ranges[i].base,
+                    dev_data->wc_ranges[i].base + dev_data->wc_ranges[i].size);
+    }
     if(!dev_data->is_zynqmp){
         /* GET HANDLES TO CLOCK STRUCTURES */
         dev_data->fclk[0] = devm_clk_get(&pdev->dev, "fclk0");
@@ -735,27 +3478,135 @@ int ucube_lkm_probe(struct platform_device *pdev){
         clk_set_rate(dev_data->fclk[3], FCLK_3_DEFAULT_FREQ);
     }
 
-    dev_data->fpga_node = of_find_compatible_node(NULL, NULL, "fpga-region");
-    if (!dev_data->fpga_node){
+    for_each_compatible_node(np, NULL, "fpga-region"){
+        if(dev_data->n_fpga_regions == UCUBE_MAX_FPGA_REGIONS){
+            of_node_put(np);
+            break;
+        }
+        pr_info("Matched fpga-region %u: %pOF\n", dev_data->n_fpga_regions, np);
+        dev_data->fpga_nodes[dev_data->n_fpga_regions++] = of_node_get(np);
+    }
+    if (!dev_data->n_fpga_regions){
         pr_warn("%s: Unable to get FPGA device node", __func__);
-        return -ENODEV;
-    } else {
-        pr_info("Matched fpga-region: %pOF\n", dev_data->fpga_node);
+        rc = -ENODEV;
+        goto out_put;
+    }
+
+    dev_data->dma_buf_size = KERNEL_BUFFER_LENGTH;
+    dev_data->dma_cached = dma_cached;
+    dev_data->sample_format = sample_format <= UCUBE_FORMAT_S24 ? sample_format : UCUBE_FORMAT_RAW;
+    /*SETUP AND ALLOCATE DMA BUFFER*/
+    if(!dev_data->is_zynqmp){
+        dma_coerce_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+    }else{
+        dma_coerce_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+    }
+    if(ucube_alloc_dma_buffer(dev_data)){
+        pr_err("%s: Failed to allocate the dma buffer\n", __func__);
+        rc = -ENOMEM;
+        goto out_put;
+    }
+    pr_warn("%s: Allocated %s dma buffer at: %llu\n", __func__, dev_data->dma_cached ? "cached" : "coherent", dev_data->physaddr);
+    
+    
+    /*SETUP AND ALLOCATE DATA BUFFER*/
+
+    if(ucube_alloc_capture_area(dev_data)){
+        pr_err("%s: Failed to allocate the capture buffer\n", __func__);
+        rc = -ENOMEM;
+        goto out_put;
+    }
+
+    name = ucube_instance_name(dev_data, "ucube_lkm");
+    dev_data->debugfs_dir = debugfs_create_dir(name ? name : "ucube_lkm", NULL);
+    kfree(name);
+    debugfs_create_file("read_latency", S_IRUGO, dev_data->debugfs_dir, dev_data->read_latency_hist, &ucube_hist_fops);
+    debugfs_create_file("copy_duration", S_IRUGO, dev_data->debugfs_dir, dev_data->copy_time_hist, &ucube_hist_fops);
+
+    /* SETUP INTERRUPT HANDLER, the threads of the instances are spread
+     * over consecutive CPUs starting from irq_cpu */
+    pr_warn("%s: setup interrupts\n", __func__);
+    dev_data->irq_thread_prio = clamp_val(irq_thread_prio, 1, MAX_RT_PRIO - 1);
+    atomic_set(&dev_data->irq_thread_prio_changed, 1);
+    rc = request_threaded_irq(dev_data->irq, ucube_lkm_irq, ucube_lkm_irq_thread, 0, dev_name(&pdev->dev), dev_data);
+    if(rc){
+        pr_err("%s: Failed to request interrupt %d\n", __func__, dev_data->irq);
+        goto out_debugfs;
+    }
+    if(irq_cpu >= 0){
+        int cpu = (irq_cpu + id) % nr_cpu_ids;
+        if(ucube_set_irq_affinity(dev_data, cpu))
+            pr_warn("%s: Unable to bind the interrupt to cpu %d\n", __func__, cpu);
+        else
+            dev_data->irq_cpu = cpu;
     }
 
+    rc = sysfs_create_group(&pdev->dev.kobj, &uscope_lkm_attr_group);
+    if(rc)
+        goto out_irq;
+
+    mutex_lock(&ucube_instances_lock);
+    ucube_instances[id] = dev_data;
+    mutex_unlock(&ucube_instances_lock);
+
+    rc = ucube_create_minors(dev_data);
+    if(rc)
+        goto out_unpublish;
+
+    pr_info("%s: instance %d ready for %pOF\n", __func__, id, pdev->dev.of_node);
     return 0;
+
+out_unpublish:
+    mutex_lock(&ucube_instances_lock);
+    ucube_instances[id] = NULL;
+    mutex_unlock(&ucube_instances_lock);
+    sysfs_remove_group(&pdev->dev.kobj, &uscope_lkm_attr_group);
+out_irq:
+    irq_set_affinity_hint(dev_data->irq, NULL);
+    free_irq(dev_data->irq, dev_data);
+out_debugfs:
+    debugfs_remove_recursive(dev_data->debugfs_dir);
+out_put:
+    kref_put(&dev_data->ref, ucube_release_instance);
+    return rc;
 }
 
+/* Stops acquisition and unpublishes the minors, the capture ring and the
+ * FPGA regions stay around until the files still open on the instance are
+ * closed. Those files only get -ENODEV from then on, and readers blocked
+ * on the instance are woken to see it. */
 int ucube_lkm_remove(struct platform_device *pdev){
+    struct scope_device_data *dev_data = platform_get_drvdata(pdev);
+
     pr_info("%s: In platform remove\n", __func__);
+    mutex_lock(&ucube_instances_lock);
+    ucube_instances[dev_data->id] = NULL;
+    mutex_unlock(&ucube_instances_lock);
+    ucube_destroy_minors(dev_data);
     sysfs_remove_group(&pdev->dev.kobj, &uscope_lkm_attr_group);
-    of_node_put(dev_data->fpga_node);
+
+    spin_lock(&dev_data->program_state_lock);
+    WRITE_ONCE(dev_data->dead, true);
+    spin_unlock(&dev_data->program_state_lock);
+
+    irq_set_affinity_hint(dev_data->irq, NULL);
+    free_irq(dev_data->irq, dev_data);
+    hrtimer_cancel(&dev_data->coalesce_timer);
+    debugfs_remove_recursive(dev_data->debugfs_dir);
+    flush_work(&dev_data->program_work);
+    ucube_free_dma_buffer(dev_data);
+
+    wake_up_interruptible_all(&dev_data->capture_wq);
+    wake_up_interruptible_all(&dev_data->trigger_wq);
+    wake_up_interruptible_all(&dev_data->program_wq);
+    kref_put(&dev_data->ref, ucube_release_instance);
     return 0;
 }
 
 
 MODULE_DEVICE_TABLE(of, ucube_lkm_match_table);
 MODULE_LICENSE("GPL");
+MODULE_IMPORT_NS(DMA_BUF);
 MODULE_AUTHOR("Filippo Savi");
 MODULE_DESCRIPTION("uScope dma handler");
 MODULE_VERSION("0.01");
@@ -0,0 +1,145 @@
+/*
+ *  uCube kernel driver tracepoints
+ *
+ * Copyright (C) 2013 University of Nottingham Ningbo China
+ * Author: Filippo Savi <filssavi@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ucube_lkm
+
+#if !defined(_UCUBE_LKM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UCUBE_LKM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Frame interrupt taken, timestamp is the value stored in the slot header */
+TRACE_EVENT(ucube_irq,
+    TP_PROTO(u64 timestamp),
+    TP_ARGS(timestamp),
+    TP_STRUCT__entry(
+        __field(u64, timestamp)
+    ),
+    TP_fast_assign(
+        __entry->timestamp = timestamp;
+    ),
+    TP_printk("timestamp=%llu", __entry->timestamp)
+);
+
+TRACE_EVENT(ucube_copy_start,
+    TP_PROTO(u64 sequence, u32 slot, u32 length, int pending),
+    TP_ARGS(sequence, slot, length, pending),
+    TP_STRUCT__entry(
+        __field(u64, sequence)
+        __field(u32, slot)
+        __field(u32, length)
+        __field(int, pending)
+    ),
+    TP_fast_assign(
+        __entry->sequence = sequence;
+        __entry->slot = slot;
+        __entry->length = length;
+        __entry->pending = pending;
+    ),
+    TP_printk("sequence=%llu slot=%u length=%u pending=%d",
+        __entry->sequence, __entry->slot, __entry->length, __entry->pending)
+);
+
+TRACE_EVENT(ucube_copy_end,
+    TP_PROTO(u64 sequence, u64 duration),
+    TP_ARGS(sequence, duration),
+    TP_STRUCT__entry(
+        __field(u64, sequence)
+        __field(u64, duration)
+    ),
+    TP_fast_assign(
+        __entry->sequence = sequence;
+        __entry->duration = duration;
+    ),
+    TP_printk("sequence=%llu duration_ns=%llu", __entry->sequence, __entry->duration)
+);
+
+TRACE_EVENT(ucube_wakeup,
+    TP_PROTO(u64 head),
+    TP_ARGS(head),
+    TP_STRUCT__entry(
+        __field(u64, head)
+    ),
+    TP_fast_assign(
+        __entry->head = head;
+    ),
+    TP_printk("head=%llu", __entry->head)
+);
+
+/* latency is the time between the frame interrupt and the copy to the reader */
+TRACE_EVENT(ucube_read,
+    TP_PROTO(u64 sequence, size_t length, u64 latency, u32 skipped),
+    TP_ARGS(sequence, length, latency, skipped),
+    TP_STRUCT__entry(
+        __field(u64, sequence)
+        __field(size_t, length)
+        __field(u64, latency)
+        __field(u32, skipped)
+    ),
+    TP_fast_assign(
+        __entry->sequence = sequence;
+        __entry->length = length;
+        __entry->latency = latency;
+        __entry->skipped = skipped;
+    ),
+    TP_printk("sequence=%llu length=%zu latency_ns=%llu skipped=%u",
+        __entry->sequence, __entry->length, __entry->latency, __entry->skipped)
+);
+
+TRACE_EVENT(ucube_program_start,
+    TP_PROTO(u32 region, u32 handle, u32 flags, size_t length),
+    TP_ARGS(region, handle, flags, length),
+    TP_STRUCT__entry(
+        __field(u32, region)
+        __field(u32, handle)
+        __field(u32, flags)
+        __field(size_t, length)
+    ),
+    TP_fast_assign(
+        __entry->region = region;
+        __entry->handle = handle;
+        __entry->flags = flags;
+        __entry->length = length;
+    ),
+    TP_printk("region=%u handle=%u flags=0x%x length=%zu",
+        __entry->region, __entry->handle, __entry->flags, __entry->length)
+);
+
+TRACE_EVENT(ucube_program_end,
+    TP_PROTO(u32 region, int result, u64 duration),
+    TP_ARGS(region, result, duration),
+    TP_STRUCT__entry(
+        __field(u32, region)
+        __field(int, result)
+        __field(u64, duration)
+    ),
+    TP_fast_assign(
+        __entry->region = region;
+        __entry->result = result;
+        __entry->duration = duration;
+    ),
+    TP_printk("region=%u result=%d duration_ns=%llu",
+        __entry->region, __entry->result, __entry->duration)
+);
+
+#endif /* _UCUBE_LKM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ucube_lkm_trace
+#include <trace/define_trace.h>